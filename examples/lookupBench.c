@@ -0,0 +1,58 @@
+/* Time of a lenv_get, from the innermost of a chain of frames like the
+   one select -> unpack -> fst makes, over the builtins and std.tyson's
+   names. Looks up a mix of locals and globals. From the top of the repo:
+     cc -std=c99 -O2 -Ilib/mpc examples/lookupBench.c lib/mpc/mpc.c -ledit -lm -o lookupBench
+     ./lookupBench */
+
+#define main tyson_main
+#include "../src/tysonlang.c"
+#undef main
+
+void bench_put(lenv* e, char* name) {
+    lval* k = lval_sym(name);
+    lenv_put(e, k, lval_num(1));
+    lval_del(k);
+}
+
+lenv* bench_frame(lenv* parent) {
+    lenv* f = lenv_new();
+    f->parent = parent;
+    return f;
+}
+
+int main(void) {
+    char* std[] = { "nil", "true", "fun", "unpack", "pack", "curry", "uncurry",
+        "do", "let", "not", "or", "and", "reverse", "fst", "snd", "nth", "last",
+        "take", "drop", "split", "in", "map", "filter", "foldLeft", "sum",
+        "cumProd", "select", "otherwise", "case" };
+    char* look[] = { "l", "xs", "cs", "head", "eval", "select", "fst", "case",
+        "otherwise", "==" };
+
+    lenv* g = lenv_new();
+    lenv_add_builtins(g);
+    for (int i = 0; i < 29; i++) { bench_put(g, std[i]); }
+    lenv* sel = bench_frame(g);
+    bench_put(sel, "cs");
+    lenv* un = bench_frame(sel);
+    bench_put(un, "f");
+    bench_put(un, "xs");
+    lenv* fst = bench_frame(un);
+    bench_put(fst, "l");
+
+    lval* keys[10];
+    for (int i = 0; i < 10; i++) { keys[i] = lval_sym(look[i]); }
+
+    int rounds = 2000000;
+    long sink = 0;
+    clock_t start = clock();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < 10; i++) {
+            lval* x = lenv_get(fst, keys[i]);
+            sink += ltype(x);
+            lval_del(x);
+        }
+    }
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%.1f ns per lookup (%ld)\n", secs * 1e9 / (rounds * 10.0), sink);
+    return 0;
+}
@@ -0,0 +1,30 @@
+/* How much memory a Q-expression of 1M numbers takes, as growth of the
+   resident set. Builds against the interpreter itself, from the top of
+   the repo:
+     cc -std=c99 -O2 -Ilib/mpc examples/memBench.c lib/mpc/mpc.c -ledit -lm -o memBench
+     ./memBench */
+
+#define main tyson_main
+#include "../src/tysonlang.c"
+#undef main
+
+#include <unistd.h>
+
+long rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f || fscanf(f, "%ld %ld", &pages, &resident) != 2) { resident = 0; }
+    if (f) { fclose(f); }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(void) {
+    long before = rss_kb();
+    lval* q = lval_qexpr();
+    for (long i = 0; i < 1000000; i++) { q = lval_add(q, lval_num(i * 7)); }
+    long after = rss_kb();
+    printf("sizeof(lval) %zu, 1M numbers: %ld KB, %.1f bytes each\n",
+        sizeof(lval), after - before, (after - before) * 1024.0 / 1e6);
+    lval_del(q);
+    return 0;
+}
@@ -1,9 +1,28 @@
+/* For MAP_ANONYMOUS, which the JIT maps its code with */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <strings.h>
+#include <time.h>
 
 #include "mpc.h"
 
+/* SIMD kernels for vectors, picked at run time */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__EMSCRIPTEN__)
+#define TYSON_SIMD
+#include <immintrin.h>
+#endif
+
+/* Native code for hot numeric lambdas, where we know how to make it */
+#if defined(__x86_64__) && !defined(__EMSCRIPTEN__) && !defined(_WIN32) && !defined(TYSON_NO_JIT)
+#define TYSON_JIT
+#include <sys/mman.h>
+#endif
+
 /* If we are compiling on Windows compile these functions */
 #ifdef _WIN32
 #include <string.h>
@@ -44,47 +63,185 @@ mpc_parser_t* Qexpr;
 mpc_parser_t* Expr;
 mpc_parser_t* Lispy;
 
+/* Set by --lexical. Functions then see the env they were created in
+   instead of the one they are called from */
+int lexical_scope = 0;
+
+/* Set by --optimize. Lambda bodies get constant folded when they are
+   created, so the names of builtins can't be bound to anything else */
+int optimize = 0;
+/* Set by --dump-optimized. Prints each body the optimizer changed */
+int dump_optimized = 0;
+
 struct lval;
 struct lenv;
+struct lsym;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lsym lsym;
 
 /* Lisp Value */
 
 enum { LVAL_ERR, LVAL_NUM,   LVAL_SYM, LVAL_STR,
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_VEC, LVAL_BIG,
+       LVAL_FLOAT, LVAL_MAP, LVAL_SET, LVAL_NODE, LVAL_SORTED,
+       LVAL_TNODE, LVAL_PQ, LVAL_HNODE };
 
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Small numbers are never allocated. They live in the lval pointer
+   itself, shifted left by one with the low bit set, so always use
+   ltype and lnum on values that may be numbers */
+#define LVAL_IS_FIXNUM(v) (((uintptr_t)(v)) & 1)
+#define FIXNUM_MIN (LONG_MIN / 2)
+#define FIXNUM_MAX (LONG_MAX / 2)
+
 struct lval {
     int type;
-    /* Basic */
-    long num;
-    char* err;
-    char* sym;
-    char* str;
-    /* Function */
-    lbuiltin builtin;  /* NULL if it's not a builtin */
-    lenv* env;
-    lval* formals;
-    lval* body;
+    /* Number of owners. Shared values are never mutated in place */
+    int refs;
+    /* Slot in the gc tracking table, -1 if not tracked */
+    int gc_slot;
+
+    /* Only the member matching type is valid */
+    union {
+        /* Number too wide to be a fixnum */
+        long num;
+        double fnum;
+        char* err;
+        /* Symbol. Under --lexical, lval_resolve records where it lives:
+        depth parents up from an env with the given scope, at slot */
+        struct {
+            lsym* sym;
+            int scope;
+            int depth;  /* -1 if not resolved */
+            int slot;
+        };
+        /* String of len bytes at str. See lval_chars */
+        struct {
+            char* str;
+            long len;
+            union { lval* sbase; lval* sleft; };
+            lval* sright;
+            int sheight;
+        };
+        /* Function */
+        struct {
+            lbuiltin builtin;  /* NULL if it's not a builtin */
+            lenv* env;
+            lval* formals;
+            lval* body;
+        };
+        /* Expression. A slice has a base: it is a view of count cells
+        inside the base list's array and owns base instead of the cells.
+        A rope is a long joined Q-expression with no cells of its own,
+        just the lists left and right, and height > 0 */
+        struct {
+            int count;
+            /* Rope height, or for a flat list the compiled code if it
+            is a lambda body: index into codes, 0 for none */
+            union { int height; int code; };
+            lval** cell;
+            union { lval* base; lval* left; };
+            lval* right;
+        };
+        /* Vector of length machine integers in one array */
+        struct {
+            int64_t* ints;
+            long length;
+        };
+        /* Number too wide for a long, see lval_big */
+        struct {
+            uint32_t* limbs;
+            int nlimbs;
+            int negative;
+        };
+        /* Hash map or set, or sorted map, of mcount entries in a trie
+        or tree of nodes from root, which is NULL while it's empty */
+        struct {
+            lval* root;
+            long mcount;
+        };
+        /* Trie node, only ever inside a map. See lval_node_put */
+        struct {
+            lval** kv;
+            uint32_t bitmap;
+            int width;
+        };
+        /* Sorted map node of tcount keys, and as many values in a leaf
+        or one more child otherwise. See lval_tnode_put */
+        struct {
+            lval** tkeys;
+            lval** titems;
+            int tcount;
+            int tleaf;
+        };
+        /* Priority queue of hsize items in a heap of nodes from hroot,
+        NULL while it's empty. horder is the comparator, NULL for < */
+        struct {
+            lval* hroot;
+            lval* horder;
+            long hsize;
+        };
+        /* Heap node, only ever inside a queue. See lval_heap_push */
+        struct {
+            lval* hitem;
+            lval* hleft;
+            lval* hright;
+        };
+    };
+};
 
-    /* Expression */
-    int count;
-    lval** cell;
+static inline int ltype(lval* v) {
+    return LVAL_IS_FIXNUM(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lnum(lval* v) {
+    return LVAL_IS_FIXNUM(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/* Interned symbol. There is exactly one per name, so symbols are
+   compared by pointer and never copied */
+struct lsym {
+    int id;
+    unsigned hash;
+    /* Set once it is bound with '=', which can shadow it after resolving */
+    int assigned;
+    /* Names a builtin. Frozen with --optimize */
+    int builtin;
+    /* How many envs bind it right now. At 1 a global is all there is */
+    int bound;
+    /* Bumped whenever it is bound, unbound or changed anywhere, so a
+    lookup remembered at one version is good for as long as it lasts */
+    unsigned version;
+    char name[];
 };
 
 struct lenv {
-    /* Parent environment. Ex global symbols and functions */
+    /* Parent environment. Ex global symbols and functions.
+    Only owned under --lexical, where it is fixed at lambda creation */
     lenv* parent;
+    int refs;
+    int gc_slot;
+    /* The lambda this is a frame of, 0 for the global env */
+    int scope;
     int count;
-    /* List of strings : variable / function names */
-    char** syms;
+    /* Room in syms and vals */
+    int capacity;
+    /* Variable / function names */
+    lsym** syms;
     /* Their values. corresponding 1 to 1*/
     lval** vals;
+    /* Hash index into syms once there are more than LENV_HASH_THRESHOLD
+    of them, NULL before that. Slots hold position + 1, 0 means empty */
+    int* index;
+    int index_capacity;
 };
 
+/* Small envs, like function frames, are faster to scan than to hash */
+#define LENV_HASH_THRESHOLD 16
+
 
 #define LASSERT(args, cond, fmt, ...) \
     if (!(cond)) { \
@@ -108,15 +265,28 @@ struct lenv {
     function_name
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, ltype(args->cell[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(ltype(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_ARG_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
     func, args->count, num)
 
+#define LASSERT_MAP(func, args, index) \
+  LASSERT(args, ltype(args->cell[index]) == LVAL_MAP || ltype(args->cell[index]) == LVAL_SET \
+    || ltype(args->cell[index]) == LVAL_SORTED, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected a map or set.", \
+    func, index, ltype_name(ltype(args->cell[index])))
+
+/* Key for the map in argument 0 */
+#define LASSERT_KEY(func, args, index, hash) \
+  LASSERT(args, lval_key_ok(args->cell[0], args->cell[index], hash), \
+    "Function '%s' passed a %s as a key, which can't be %s.", \
+    func, ltype_name(ltype(args->cell[index])), \
+    ltype(args->cell[0]) == LVAL_SORTED ? "ordered" : "hashed")
+
 #define LASSERT_NOT_EMPTY(func, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
@@ -130,21 +300,275 @@ char* ltype_name(int t) {
         case LVAL_STR: return "String";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_VEC: return "Vector";
+        case LVAL_BIG: return "Big Number";
+        case LVAL_FLOAT: return "Float";
+        case LVAL_MAP: return "Hash Map";
+        case LVAL_SET: return "Hash Set";
+        case LVAL_SORTED: return "Sorted Map";
+        case LVAL_PQ: return "Priority Queue";
         default: return "Unknown";
     }
 }
 
+/* Memory pools
+
+   Values, envs and small arrays (cells, env slots) are recycled through
+   one free list per 16 byte size class instead of going through malloc
+   every time. Blocks are carved out of large slabs that are never given
+   back. Anything above POOL_MAX_SIZE goes straight to malloc.
+   Build with -DTYSON_NO_POOL to use plain malloc / free, e.g. for ASan. */
+
+#define POOL_GRANULARITY 16
+#define POOL_MAX_SIZE 1024
+#define POOL_SLAB_SIZE (64 * 1024)
+
+#ifdef TYSON_NO_POOL
+
+void* pool_alloc(size_t size) { return malloc(size); }
+void pool_free(void* p, size_t size) { free(p); }
+void* pool_realloc(void* p, size_t old_size, size_t new_size) {
+    if (new_size == 0) { free(p); return NULL; }
+    return realloc(p, new_size);
+}
+
+#else
+
+typedef struct pool_block { struct pool_block* next; } pool_block;
+
+static pool_block* pool_free_lists[POOL_MAX_SIZE / POOL_GRANULARITY];
+
+int pool_class(size_t size) {
+    return (int)((size - 1) / POOL_GRANULARITY);
+}
+
+void pool_refill(int class) {
+    /* Carve a new slab into blocks of this class */
+    size_t block_size = (size_t)(class + 1) * POOL_GRANULARITY;
+    char* slab = malloc(POOL_SLAB_SIZE);
+    for (size_t off = 0; off + block_size <= POOL_SLAB_SIZE; off += block_size) {
+        pool_block* b = (pool_block*)(slab + off);
+        b->next = pool_free_lists[class];
+        pool_free_lists[class] = b;
+    }
+}
+
+void* pool_alloc(size_t size) {
+    if (size == 0) { return NULL; }
+    if (size > POOL_MAX_SIZE) { return malloc(size); }
+
+    int class = pool_class(size);
+    if (!pool_free_lists[class]) { pool_refill(class); }
+
+    pool_block* b = pool_free_lists[class];
+    pool_free_lists[class] = b->next;
+    return b;
+}
+
+void pool_free(void* p, size_t size) {
+    /* size must be what p was allocated (or last resized) with */
+    if (!p) { return; }
+    if (size > POOL_MAX_SIZE) { free(p); return; }
+
+    int class = pool_class(size);
+    pool_block* b = p;
+    b->next = pool_free_lists[class];
+    pool_free_lists[class] = b;
+}
+
+void* pool_realloc(void* p, size_t old_size, size_t new_size) {
+    if (!p) { return pool_alloc(new_size); }
+    if (new_size == 0) { pool_free(p, old_size); return NULL; }
+    if (old_size > POOL_MAX_SIZE && new_size > POOL_MAX_SIZE) {
+        return realloc(p, new_size);
+    }
+    /* Still fits the block we have */
+    if (old_size <= POOL_MAX_SIZE && new_size <= POOL_MAX_SIZE
+        && pool_class(old_size) == pool_class(new_size)) {
+        return p;
+    }
+
+    void* n = pool_alloc(new_size);
+    memcpy(n, p, old_size < new_size ? old_size : new_size);
+    pool_free(p, old_size);
+    return n;
+}
+
+#endif
+
+/* Garbage collection
+
+   Reference counting frees values as soon as their last owner lets go,
+   but it can never free a reference cycle. Every container value (lists
+   and lambdas) and every env is therefore tracked in a table, and a trial
+   deletion pass over that table finds the ones kept alive only by each
+   other, e.g. a closure stored in the frame it captured.
+   Roots never have to be listed: a reference from the global env, the C
+   eval stack or a local in builtin_load / the REPL shows up as a count
+   that the tracked containers alone can't explain. */
+
+/* Collect when this many containers are tracked, at the least */
+#define GC_MIN_THRESHOLD 1024
+
+typedef struct {
+    /* Exactly one of v and e is set */
+    lval* v;
+    lenv* e;
+    /* Scratch count used while collecting. -1 once known reachable */
+    int gc_refs;
+} gc_entry;
+
+struct {
+    gc_entry* tracked;
+    int count;
+    int capacity;
+    /* Collect once count reaches this. Grows with the surviving heap */
+    int threshold;
+    int collecting;
+
+    long values;
+    long envs;
+    long collections;
+    long freed;
+    long pause_last;  /* microseconds */
+    long pause_max;
+    long pause_total;
+} gc = { NULL, 0, 0, GC_MIN_THRESHOLD };
+
+void gc_collect(void);
+
+lval* lval_new(int type) {
+    lval* v = pool_alloc(sizeof(lval));
+    v->type = type;
+    v->refs = 1;
+    v->gc_slot = -1;
+    gc.values++;
+    return v;
+}
+
+int gc_add(lval* v, lenv* e) {
+    if (gc.count == gc.capacity) {
+        gc.capacity = gc.capacity ? gc.capacity * 2 : GC_MIN_THRESHOLD;
+        gc.tracked = realloc(gc.tracked, sizeof(gc_entry) * gc.capacity);
+    }
+    gc.tracked[gc.count].v = v;
+    gc.tracked[gc.count].e = e;
+    return gc.count++;
+}
+
+void gc_remove(int slot) {
+    /* Move the last entry into the freed slot */
+    gc_entry last = gc.tracked[--gc.count];
+    gc.tracked[slot] = last;
+    if (last.v) { last.v->gc_slot = slot; } else { last.e->gc_slot = slot; }
+}
+
+/* Only track once fully built, since it may start a collection */
+
+void gc_track(lval* v) {
+    v->gc_slot = gc_add(v, NULL);
+    if (gc.count >= gc.threshold && !gc.collecting) { gc_collect(); }
+}
+
+void gc_track_env(lenv* e) {
+    e->gc_slot = gc_add(NULL, e);
+    if (gc.count >= gc.threshold && !gc.collecting) { gc_collect(); }
+}
+
+void gc_untrack(lval* v) {
+    gc_remove(v->gc_slot);
+    v->gc_slot = -1;
+}
+
+void gc_untrack_env(lenv* e) {
+    gc_remove(e->gc_slot);
+    e->gc_slot = -1;
+}
+
+/* Symbol table
+
+   Open addressing hash set of every symbol name ever read. Interned
+   symbols live for the rest of the program */
+
+struct {
+    lsym** slots;
+    int capacity;
+    int count;
+} symtab = { NULL, 0, 0 };
+
+/* Symbols the interpreter itself looks for */
+lsym* sym_amp;
+
+unsigned lsym_hash(char* s) {
+    /* FNV-1a */
+    unsigned h = 2166136261u;
+    while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+    return h;
+}
+
+void symtab_grow(void) {
+    int old_capacity = symtab.capacity;
+    lsym** old = symtab.slots;
+
+    symtab.capacity = old_capacity ? old_capacity * 2 : 256;
+    symtab.slots = calloc(symtab.capacity, sizeof(lsym*));
+    for (int i = 0; i < old_capacity; i++) {
+        if (!old[i]) { continue; }
+        unsigned j = old[i]->hash & (symtab.capacity - 1);
+        while (symtab.slots[j]) { j = (j + 1) & (symtab.capacity - 1); }
+        symtab.slots[j] = old[i];
+    }
+    free(old);
+}
+
+lsym* lsym_intern(char* name) {
+    /* Keep the table at most half full */
+    if ((symtab.count + 1) * 2 > symtab.capacity) { symtab_grow(); }
+
+    unsigned h = lsym_hash(name);
+    unsigned j = h & (symtab.capacity - 1);
+    while (symtab.slots[j]) {
+        if (symtab.slots[j]->hash == h && strcmp(symtab.slots[j]->name, name) == 0) {
+            return symtab.slots[j];
+        }
+        j = (j + 1) & (symtab.capacity - 1);
+    }
+
+    lsym* s = malloc(sizeof(lsym) + strlen(name) + 1);
+    s->id = symtab.count++;
+    s->hash = h;
+    s->assigned = 0;
+    s->builtin = 0;
+    s->bound = 0;
+    s->version = 0;
+    strcpy(s->name, name);
+    symtab.slots[j] = s;
+    return s;
+}
+
+static inline void lsym_bound(lsym* s, int n) {
+    s->bound += n;
+    s->version++;
+}
+
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    if (x >= FIXNUM_MIN && x <= FIXNUM_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | 1);
+    }
+    lval* v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 
+lval* lval_float(double x) {
+    lval* v = lval_new(LVAL_FLOAT);
+    v->fnum = x;
+    return v;
+}
+
 /* Construct a pointer to a new Error lval */
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval* v = lval_new(LVAL_ERR);
 
     va_list va;
     va_start(va, fmt);
@@ -163,58 +587,143 @@ lval* lval_err(char* fmt, ...) {
 
 
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    lval* v = lval_new(LVAL_SYM);
+    v->sym = lsym_intern(s);
+    v->scope = 0;
+    v->depth = -1;
+    v->slot = 0;
     return v;
 }
 
-lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+lval* lval_str_own(char* s, long len) {
+    /* String taking over s, which holds len bytes and a NUL */
+    lval* v = lval_new(LVAL_STR);
+    v->str = s;
+    v->len = len;
+    v->sbase = NULL;
+    v->sright = NULL;
+    v->sheight = 0;
     return v;
 }
 
+lval* lval_str_n(const char* s, long len) {
+    char* copy = malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return lval_str_own(copy, len);
+}
+
+lval* lval_str(char* s) {
+    return lval_str_n(s, strlen(s));
+}
+
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_new(LVAL_SEXPR);
     v->count = 0;
     v->cell =   NULL;
+    v->base = NULL;
+    v->right = NULL;
+    v->height = 0;
+    gc_track(v);
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_new(LVAL_QEXPR);
     v->count = 0;
     v->cell = NULL;
+    v->base = NULL;
+    v->right = NULL;
+    v->height = 0;
+    gc_track(v);
+    return v;
+}
+
+lval* lval_map(int type) {
+    /* Empty hash map, or hash set for LVAL_SET */
+    lval* v = lval_new(type);
+    v->root = NULL;
+    v->mcount = 0;
+    gc_track(v);
+    return v;
+}
+
+lval* lval_node(uint32_t bitmap, int width) {
+    /* Trie node with room for width entries, all NULL for now */
+    lval* v = lval_new(LVAL_NODE);
+    v->bitmap = bitmap;
+    v->width = width;
+    v->kv = NULL;
+    if (width) {
+        v->kv = pool_alloc(sizeof(lval*) * 2 * width);
+        memset(v->kv, 0, sizeof(lval*) * 2 * width);
+    }
+    gc_track(v);
+    return v;
+}
+
+/* Most keys in a sorted map node. Only the root may have under half */
+#define TREE_MAX 32
+#define TREE_MIN (TREE_MAX / 2)
+
+lval* lval_tnode(int leaf) {
+    /* Empty sorted map node, with room for one key too many until it splits */
+    lval* v = lval_new(LVAL_TNODE);
+    v->tkeys = pool_alloc(sizeof(lval*) * (2 * TREE_MAX + 3));
+    v->titems = v->tkeys + TREE_MAX + 1;
+    v->titems[0] = NULL;  /* The one child of a node with no keys yet */
+    v->tcount = 0;
+    v->tleaf = leaf;
+    gc_track(v);
+    return v;
+}
+
+lval* lval_pq(lval* root, lval* order, long size) {
+    /* Priority queue over a heap. Takes root and order, either may be NULL */
+    lval* v = lval_new(LVAL_PQ);
+    v->hroot = root;
+    v->horder = order;
+    v->hsize = size;
+    gc_track(v);
+    return v;
+}
+
+lval* lval_hnode(lval* item, lval* left, lval* right) {
+    /* Heap node. Takes all three, the two below may be NULL */
+    lval* v = lval_new(LVAL_HNODE);
+    v->hitem = item;
+    v->hleft = left;
+    v->hright = right;
+    gc_track(v);
     return v;
 }
 
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_new(LVAL_FUN);
     v->builtin = func;
     return v;
 }
 
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = pool_alloc(sizeof(lenv));
+    gc.envs++;
 
+    e->refs = 1;
+    e->scope = 0;
     e->count = 0;
+    e->capacity = 0;
     e->parent = NULL;
     e->syms = NULL;
     e->vals = NULL;
+    e->index = NULL;
+    e->index_capacity = 0;
+    gc_track_env(e);
 
     return e;
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_new(LVAL_FUN);
     v->builtin = NULL;
 
     /* Inner env within func */
@@ -222,29 +731,80 @@ lval* lval_lambda(lval* formals, lval* body) {
 
     v->formals = formals;
     v->body = body;
+    gc_track(v);
     return v;
 }
 
 void lval_del(lval* v);
+void lcode_free(int code);
+
+lenv* lenv_ref(lenv* e) {
+    e->refs++;
+    return e;
+}
 
 void lenv_del(lenv* e) {
+    if (--e->refs > 0) { return; }
+
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
+        lsym_bound(e->syms[i], -1);
         lval_del(e->vals[i]);
     }
 
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    pool_free(e->syms, sizeof(lsym*) * e->capacity);
+    pool_free(e->vals, sizeof(lval*) * e->capacity);
+    pool_free(e->index, sizeof(int) * e->index_capacity);
+    if (lexical_scope && e->parent) { lenv_del(e->parent); }
+    gc_untrack_env(e);
+    pool_free(e, sizeof(lenv));
+    gc.envs--;
+}
+
+lval* lval_ref(lval* v) {
+    /* Hand out another reference to v instead of copying it */
+    if (!LVAL_IS_FIXNUM(v)) { v->refs++; }
+    return v;
 }
 
 void lval_del(lval* v) {
+    /* Only the last owner actually frees the value */
+    if (LVAL_IS_FIXNUM(v) || --v->refs > 0) { return; }
 
     switch (v->type) {
         case LVAL_NUM: break;
         case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break;
+        case LVAL_STR:
+            if (v->sheight) { lval_del(v->sleft); lval_del(v->sright); }
+            else if (v->sbase) { lval_del(v->sbase); }
+            else { free(v->str); }
+            break;
+        case LVAL_VEC: free(v->ints); break;
+        case LVAL_BIG: free(v->limbs); break;
+        case LVAL_MAP:
+        case LVAL_SET:
+        case LVAL_SORTED: if (v->root) { lval_del(v->root); } break;
+        case LVAL_NODE:
+            for (int i = 0; i < 2 * v->width; i++) {
+                if (v->kv[i]) { lval_del(v->kv[i]); }
+            }
+            pool_free(v->kv, sizeof(lval*) * 2 * v->width);
+            break;
+        case LVAL_TNODE:
+            for (int i = 0; i < v->tcount; i++) { lval_del(v->tkeys[i]); }
+            for (int i = 0; i < v->tcount + !v->tleaf; i++) {
+                if (v->titems[i]) { lval_del(v->titems[i]); }
+            }
+            pool_free(v->tkeys, sizeof(lval*) * (2 * TREE_MAX + 3));
+            break;
+        case LVAL_PQ:
+            if (v->hroot) { lval_del(v->hroot); }
+            if (v->horder) { lval_del(v->horder); }
+            break;
+        case LVAL_HNODE:
+            if (v->hitem) { lval_del(v->hitem); }
+            if (v->hleft) { lval_del(v->hleft); }
+            if (v->hright) { lval_del(v->hright); }
+            break;
         case LVAL_FUN:
             if (!v->builtin) {
                 lenv_del(v->env);
@@ -256,25 +816,44 @@ void lval_del(lval* v) {
         /* If it's a sexpr or Qexpr, delete all elements inside. */
         case LVAL_QEXPR:
         case LVAL_SEXPR:
+            if (v->right) { lval_del(v->right); }
+            else if (v->code) { lcode_free(v->code); }
+            if (v->base) { lval_del(v->base); break; }
             for (int i = 0; i < v->count; i++) {
                 lval_del(v->cell[i]);
             }
-            free(v->cell);
+            pool_free(v->cell, sizeof(lval*) * v->count);
             break;
     }
-    free(v);
+    if (v->gc_slot != -1) { gc_untrack(v); }
+    pool_free(v, sizeof(lval));
+    gc.values--;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
+lval* lval_big_read(char* s);
+
+lval* lval_read_number(char* s) {
+  if (strpbrk(s, ".eE")) {
+    double x = strtod(s, NULL);
+    return isinf(x) ? lval_err("invalid number") : lval_float(x);
+  }
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
+  long x = strtol(s, NULL, 10);
   return errno != ERANGE ?
-    lval_num(x) : lval_err("invalid number");
+    lval_num(x) : lval_big_read(s);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+  return lval_read_number(t->contents);
 }
 
+void lval_flatten(lval* v);
+
 lval* lval_add(lval* v, lval* x) {
+  if (v->base) { lval_flatten(v); }
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = pool_realloc(v->cell,
+    sizeof(lval*) * (v->count-1), sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
   return v;
 }
@@ -282,29 +861,80 @@ lval* lval_add(lval* v, lval* x) {
 lval* lval_copy(lval* v);
 
 lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
+    lenv* n = pool_alloc(sizeof(lenv));
+    gc.envs++;
+    n->refs = 1;
+    n->scope = e->scope;
     n->parent = e->parent;
+    if (lexical_scope && n->parent) { lenv_ref(n->parent); }
     n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
+    n->capacity = e->count;
+    n->syms = pool_alloc(sizeof(lsym*) * n->count);
+    n->vals = pool_alloc(sizeof(lval*) * n->count);
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = e->syms[i];
+        lsym_bound(n->syms[i], 1);
+        n->vals[i] = lval_ref(e->vals[i]);
+    }
+    n->index = NULL;
+    n->index_capacity = e->index_capacity;
+    if (e->index) {
+        n->index = pool_alloc(sizeof(int) * n->index_capacity);
+        memcpy(n->index, e->index, sizeof(int) * n->index_capacity);
     }
+    gc_track_env(n);
     return n;
 }
 
-lval* lval_copy(lval* v) {
+lval* lval_cells(lval* v);
+char* lval_chars(lval* v);
 
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+lval* lval_copy(lval* v) {
+    /* Shallow copy: a new top level value whose children are shared */
+    if (LVAL_IS_FIXNUM(v)) { return v; }
+    lval* x = lval_new(v->type);
     switch (v->type) {
         case LVAL_NUM: x->num = v->num; break;
+        case LVAL_FLOAT: x->fnum = v->fnum; break;
 
         case LVAL_STR:
-            x->str = malloc(strlen(v->str) + 1);
-            strcpy(x->str, v->str);
+            x->str = malloc(v->len + 1);
+            memcpy(x->str, lval_chars(v), v->len);
+            x->str[v->len] = '\0';
+            x->len = v->len;
+            x->sbase = NULL;
+            x->sright = NULL;
+            x->sheight = 0;
+            break;
+
+        case LVAL_VEC:
+            x->length = v->length;
+            x->ints = malloc(sizeof(int64_t) * v->length);
+            memcpy(x->ints, v->ints, sizeof(int64_t) * v->length);
+            break;
+
+        case LVAL_BIG:
+            x->nlimbs = v->nlimbs;
+            x->negative = v->negative;
+            x->limbs = malloc(sizeof(uint32_t) * (v->nlimbs ? v->nlimbs : 1));
+            memcpy(x->limbs, v->limbs, sizeof(uint32_t) * v->nlimbs);
+            break;
+
+        /* Shares the whole trie. Changing either copies the nodes on the way */
+        case LVAL_MAP:
+        case LVAL_SET:
+        case LVAL_SORTED:
+            x->root = v->root ? lval_ref(v->root) : NULL;
+            x->mcount = v->mcount;
+            gc_track(x);
+            break;
+
+        /* Same for the heap */
+        case LVAL_PQ:
+            x->hroot = v->hroot ? lval_ref(v->hroot) : NULL;
+            x->horder = v->horder ? lval_ref(v->horder) : NULL;
+            x->hsize = v->hsize;
+            gc_track(x);
             break;
 
         case LVAL_FUN:
@@ -314,8 +944,9 @@ lval* lval_copy(lval* v) {
             else {
                 x->builtin = NULL;
                 x->env = lenv_copy(v->env);
-                x->body = lval_copy(v->body);
-                x->formals = lval_copy(v->formals);
+                x->body = lval_ref(v->body);
+                x->formals = lval_ref(v->formals);
+                gc_track(x);
             }
             break;
 
@@ -325,21 +956,327 @@ lval* lval_copy(lval* v) {
             strcpy(x->err, v->err); break;
 
         case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym); break;
+            x->sym = v->sym;
+            x->scope = v->scope;
+            x->depth = v->depth;
+            x->slot = v->slot;
+            break;
 
             case LVAL_QEXPR:
             case LVAL_SEXPR:
+                /* A copy of a slice or rope is a flat list of its cells */
+                lval_cells(v);
                 x->count = v->count;
-                x->cell = malloc(sizeof(lval*) * x->count);
+                x->base = NULL;
+                x->right = NULL;
+                x->height = 0;
+                x->cell = pool_alloc(sizeof(lval*) * x->count);
                 for (int i = 0; i < x->count; i++) {
-                    x->cell[i] = lval_copy(v->cell[i]);
+                    x->cell[i] = lval_ref(v->cell[i]);
                 }
+                gc_track(x);
                 break;
     }
     return x;
 }
 
+int lval_is_slice(lval* v) {
+    return (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR)
+        && v->base && !v->right;
+}
+
+int lval_is_rope(lval* v) {
+    return (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR) && v->right;
+}
+
+lval** lval_rope_fill(lval* v, lval** cell) {
+    if (!v->right) {
+        for (int i = 0; i < v->count; i++) { *cell++ = lval_ref(v->cell[i]); }
+        return cell;
+    }
+    return lval_rope_fill(v->right, lval_rope_fill(v->left, cell));
+}
+
+lval* lval_cells(lval* v) {
+    /* Makes v->cell usable. A rope is turned into a flat list in place.
+    Its value stays the same, so this is fine on shared lists too */
+    if (!lval_is_rope(v)) { return v; }
+    lval** cell = pool_alloc(sizeof(lval*) * v->count);
+    lval_rope_fill(v, cell);
+    lval_del(v->left);
+    lval_del(v->right);
+    v->left = v->right = NULL;
+    v->height = 0;
+    v->cell = cell;
+    return v;
+}
+
+void lval_flatten(lval* v) {
+    /* Give a slice or rope its own cell array. v must be owned */
+    if (lval_is_rope(v)) { lval_cells(v); return; }
+    lval** cell = pool_alloc(sizeof(lval*) * v->count);
+    for (int i = 0; i < v->count; i++) { cell[i] = lval_ref(v->cell[i]); }
+    lval_del(v->base);
+    v->base = NULL;
+    v->cell = cell;
+}
+
+lval* lval_own(lval* v) {
+    /* Copy on write. Returns v itself if we are its only owner,
+    otherwise gives up our reference and returns a private copy.
+    Either way the result is a flat list, so its cells can be changed */
+    if (LVAL_IS_FIXNUM(v)) { return v; }
+    if (v->refs == 1) {
+        if (lval_is_slice(v) || lval_is_rope(v)) { lval_flatten(v); }
+        return v;
+    }
+    lval* x = lval_copy(v);
+    v->refs--;
+    return x;
+}
+
+lval* lval_rope_slice(lval* v, int start, int count);
+
+lval* lval_slice(lval* v, int start, int count) {
+    /* View of count cells of list v from start, in O(1) or O(log n) for
+    a rope. Takes ownership of v. Slices of slices share the original base */
+    if (lval_is_rope(v)) { return lval_rope_slice(v, start, count); }
+
+    lval** cell = v->cell + start;
+
+    if (lval_is_slice(v) && v->refs == 1) {
+        v->cell = cell;
+        v->count = count;
+        return v;
+    }
+
+    lval* x = lval_new(v->type);
+    x->base = lval_ref(v->base ? v->base : v);
+    x->right = NULL;
+    x->height = 0;
+    x->cell = cell;
+    x->count = count;
+    lval_del(v);
+    gc_track(x);
+    return x;
+}
+
+typedef void(*gc_visitor)(int slot);
+void lcode_visit(int code, gc_visitor visit);
+
+void gc_visit_val(lval* v, gc_visitor visit) {
+    if (!LVAL_IS_FIXNUM(v) && v->gc_slot != -1) { visit(v->gc_slot); }
+}
+
+void gc_visit(int slot, gc_visitor visit) {
+    /* Calls visit on the slot of everything the entry holds a reference to */
+    lval* v = gc.tracked[slot].v;
+    lenv* e = gc.tracked[slot].e;
+
+    if (e) {
+        for (int i = 0; i < e->count; i++) { gc_visit_val(e->vals[i], visit); }
+        /* Only lexical scoping owns the parent */
+        if (lexical_scope && e->parent) { visit(e->parent->gc_slot); }
+        return;
+    }
+
+    switch (v->type) {
+        case LVAL_FUN:
+            gc_visit_val(v->formals, visit);
+            gc_visit_val(v->body, visit);
+            visit(v->env->gc_slot);
+            break;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (v->right) { gc_visit_val(v->right, visit); }
+            else if (v->code) { lcode_visit(v->code, visit); }
+            if (v->base) { gc_visit_val(v->base, visit); break; }
+            for (int i = 0; i < v->count; i++) {
+                if (v->cell[i]) { gc_visit_val(v->cell[i], visit); }
+            }
+            break;
+        case LVAL_MAP:
+        case LVAL_SET:
+        case LVAL_SORTED:
+            if (v->root) { gc_visit_val(v->root, visit); }
+            break;
+        case LVAL_NODE:
+            for (int i = 0; i < 2 * v->width; i++) {
+                if (v->kv[i]) { gc_visit_val(v->kv[i], visit); }
+            }
+            break;
+        case LVAL_TNODE:
+            for (int i = 0; i < v->tcount; i++) { gc_visit_val(v->tkeys[i], visit); }
+            for (int i = 0; i < v->tcount + !v->tleaf; i++) {
+                if (v->titems[i]) { gc_visit_val(v->titems[i], visit); }
+            }
+            break;
+        case LVAL_PQ:
+            if (v->hroot) { gc_visit_val(v->hroot, visit); }
+            if (v->horder) { gc_visit_val(v->horder, visit); }
+            break;
+        case LVAL_HNODE:
+            if (v->hitem) { gc_visit_val(v->hitem, visit); }
+            if (v->hleft) { gc_visit_val(v->hleft, visit); }
+            if (v->hright) { gc_visit_val(v->hright, visit); }
+            break;
+    }
+}
+
+void gc_subtract_ref(int slot) {
+    gc.tracked[slot].gc_refs--;
+}
+
+/* Work list of slots known to be reachable */
+static int* gc_stack;
+static int gc_stack_count;
+
+void gc_mark_reachable(int slot) {
+    if (gc.tracked[slot].gc_refs == -1) { return; }
+    gc.tracked[slot].gc_refs = -1;
+    gc_stack[gc_stack_count++] = slot;
+}
+
+void gc_clear(gc_entry* x) {
+    /* Drop every reference it holds, leaving an empty husk */
+    if (x->e) {
+        for (int i = 0; i < x->e->count; i++) {
+            lsym_bound(x->e->syms[i], -1);
+            lval_del(x->e->vals[i]);
+        }
+        pool_free(x->e->syms, sizeof(lsym*) * x->e->capacity);
+        pool_free(x->e->vals, sizeof(lval*) * x->e->capacity);
+        pool_free(x->e->index, sizeof(int) * x->e->index_capacity);
+        x->e->syms = NULL;
+        x->e->vals = NULL;
+        x->e->index = NULL;
+        x->e->count = x->e->capacity = x->e->index_capacity = 0;
+        if (lexical_scope && x->e->parent) { lenv_del(x->e->parent); }
+        x->e->parent = NULL;
+        return;
+    }
+
+    lval* v = x->v;
+    switch (v->type) {
+        case LVAL_FUN:
+            lenv_del(v->env);
+            lval_del(v->formals);
+            lval_del(v->body);
+            v->env = lenv_new();
+            v->formals = lval_qexpr();
+            v->body = lval_qexpr();
+            break;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (v->right) {
+                lval_del(v->right);
+                v->right = NULL;
+                v->height = 0;
+            } else if (v->code) {
+                lcode_free(v->code);
+                v->code = 0;
+            }
+            if (v->base) {
+                lval_del(v->base);
+                v->base = NULL;
+            } else {
+                for (int i = 0; i < v->count; i++) { lval_del(v->cell[i]); }
+                pool_free(v->cell, sizeof(lval*) * v->count);
+            }
+            v->count = 0;
+            v->cell = NULL;
+            break;
+        case LVAL_MAP:
+        case LVAL_SET:
+        case LVAL_SORTED:
+            if (v->root) { lval_del(v->root); }
+            v->root = NULL;
+            v->mcount = 0;
+            break;
+        case LVAL_TNODE:
+            for (int i = 0; i < v->tcount; i++) { lval_del(v->tkeys[i]); }
+            for (int i = 0; i < v->tcount + !v->tleaf; i++) {
+                if (v->titems[i]) { lval_del(v->titems[i]); }
+            }
+            v->tcount = 0;
+            v->tleaf = 1;
+            break;
+        case LVAL_PQ:
+            if (v->hroot) { lval_del(v->hroot); }
+            if (v->horder) { lval_del(v->horder); }
+            v->hroot = v->horder = NULL;
+            v->hsize = 0;
+            break;
+        case LVAL_HNODE:
+            if (v->hitem) { lval_del(v->hitem); }
+            if (v->hleft) { lval_del(v->hleft); }
+            if (v->hright) { lval_del(v->hright); }
+            v->hitem = v->hleft = v->hright = NULL;
+            break;
+        case LVAL_NODE:
+            for (int i = 0; i < 2 * v->width; i++) {
+                if (v->kv[i]) { lval_del(v->kv[i]); }
+            }
+            pool_free(v->kv, sizeof(lval*) * 2 * v->width);
+            v->kv = NULL;
+            v->bitmap = 0;
+            v->width = 0;
+            break;
+    }
+}
+
+void gc_collect(void) {
+    clock_t start = clock();
+    gc.collecting = 1;
+
+    /* Start from the real counts, then take away every reference that
+    comes from another tracked object. Whatever is left is held from outside */
+    for (int i = 0; i < gc.count; i++) {
+        gc_entry* x = &gc.tracked[i];
+        x->gc_refs = x->v ? x->v->refs : x->e->refs;
+    }
+    for (int i = 0; i < gc.count; i++) {
+        gc_visit(i, gc_subtract_ref);
+    }
+
+    /* Held from outside means reachable, and so is all it refers to */
+    gc_stack = malloc(sizeof(int) * gc.count);
+    gc_stack_count = 0;
+    for (int i = 0; i < gc.count; i++) {
+        if (gc.tracked[i].gc_refs > 0) { gc_mark_reachable(i); }
+    }
+    while (gc_stack_count) {
+        gc_visit(gc_stack[--gc_stack_count], gc_mark_reachable);
+    }
+    free(gc_stack);
+
+    /* The rest only keep each other alive. Hold on to them while the
+    cycles are broken so none is freed half way through */
+    gc_entry* dead = malloc(sizeof(gc_entry) * gc.count);
+    int dead_count = 0;
+    for (int i = 0; i < gc.count; i++) {
+        if (gc.tracked[i].gc_refs != -1) { dead[dead_count++] = gc.tracked[i]; }
+    }
+    for (int i = 0; i < dead_count; i++) {
+        if (dead[i].v) { lval_ref(dead[i].v); } else { lenv_ref(dead[i].e); }
+    }
+    for (int i = 0; i < dead_count; i++) { gc_clear(&dead[i]); }
+    for (int i = 0; i < dead_count; i++) {
+        if (dead[i].v) { lval_del(dead[i].v); } else { lenv_del(dead[i].e); }
+    }
+    free(dead);
+
+    gc.threshold = gc.count * 2 > GC_MIN_THRESHOLD ?
+        gc.count * 2 : GC_MIN_THRESHOLD;
+    gc.collecting = 0;
+
+    gc.collections++;
+    gc.freed += dead_count;
+    gc.pause_last = (long)((clock() - start) * 1000000 / CLOCKS_PER_SEC);
+    gc.pause_total += gc.pause_last;
+    if (gc.pause_last > gc.pause_max) { gc.pause_max = gc.pause_last; }
+}
+
 lval* lval_read_str(mpc_ast_t* t) {
     /* Cut off the final quote character */
     t->contents[strlen(t->contents)-1] = '\0';
@@ -348,11 +1285,8 @@ lval* lval_read_str(mpc_ast_t* t) {
     strcpy(unescaped, t->contents+1);
     /* Pass through the unescape function */
     unescaped = mpcf_unescape(unescaped);
-    /* Construct a new lval using the string */
-    lval* str = lval_str(unescaped);
-    /* Free the string and return */
-    free(unescaped);
-    return str;
+    /* Construct a new lval using the string, which it keeps */
+    return lval_str_own(unescaped, strlen(unescaped));
 }
 
 lval* lval_read(mpc_ast_t* t) {
@@ -386,6 +1320,7 @@ lval* lval_eval(lenv* e, lval* v);
 void lval_print(lval* v);
 
 void lval_expr_print(lval* v, char open, char close) {
+    lval_cells(v);
     putchar(open);
     for (int i = 0; i < v->count; i++) {
 
@@ -398,22 +1333,96 @@ void lval_expr_print(lval* v, char open, char close) {
     putchar(close);
 }
 
+char* lval_str_dup(lval* v);
+
 void lval_print_str(lval* v) {
-    char* escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
-    escaped = mpcf_escape(escaped);
+    char* escaped = mpcf_escape(lval_str_dup(v));
     printf("\"%s\"", escaped);
     free(escaped);
 }
 
+lval** lval_map_entries(lval* m, lval*** vals);
+
+void lval_map_print(lval* v) {
+    /* As the code that makes it */
+    lval** vals;
+    lval** keys = lval_map_entries(v, &vals);
+    printf(v->type == LVAL_MAP ? "(hashmap {" : v->type == LVAL_SET ? "(hashset {" : "(sortedmap {");
+    for (long i = 0; i < v->mcount; i++) {
+        if (i) { putchar(' '); }
+        if (v->type == LVAL_SET) { lval_print(keys[i]); continue; }
+        putchar('{');
+        lval_print(keys[i]);
+        putchar(' ');
+        lval_print(vals[i]);
+        putchar('}');
+    }
+    printf("})");
+    free(keys);
+    free(vals);
+}
+
+int lval_heap_fill(lval* n, lval** cell, int count) {
+    /* Puts the items of heap n in cell from index count on, each before
+    the ones below it. Gives back where they got up to */
+    cell[count++] = n->hitem;
+    if (n->hleft) { count = lval_heap_fill(n->hleft, cell, count); }
+    if (n->hright) { count = lval_heap_fill(n->hright, cell, count); }
+    return count;
+}
+
+void lval_pq_print(lval* v) {
+    /* As the code that makes it. The first item is the one on top */
+    printf("(pq ");
+    if (v->horder) {
+        lval_print(v->horder);
+        putchar(' ');
+    }
+    putchar('{');
+    lval** cell = malloc(sizeof(lval*) * (v->hsize ? v->hsize : 1));
+    if (v->hroot) { lval_heap_fill(v->hroot, cell, 0); }
+    for (long i = 0; i < v->hsize; i++) {
+        if (i) { putchar(' '); }
+        lval_print(cell[i]);
+    }
+    printf("})");
+    free(cell);
+}
+
+char* lval_big_str(lval* v);
+void lval_float_str(char* buf, size_t size, double x);
+
 void lval_print(lval* v) {
-    switch (v->type) {
-        case LVAL_NUM:   printf("%li", v->num); break;
+    switch (ltype(v)) {
+        case LVAL_NUM:   printf("%li", lnum(v)); break;
+        case LVAL_FLOAT: {
+            char digits[32];
+            lval_float_str(digits, sizeof(digits), v->fnum);
+            fputs(digits, stdout);
+            break;
+        }
+        case LVAL_BIG: {
+            char* digits = lval_big_str(v);
+            fputs(digits, stdout);
+            free(digits);
+            break;
+        }
         case LVAL_ERR:   printf("Error: %s", v->err); break;
-        case LVAL_SYM:   printf("%s", v->sym); break;
+        case LVAL_SYM:   printf("%s", v->sym->name); break;
         case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
         case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
         case LVAL_STR:   lval_print_str(v); break;
+        case LVAL_VEC:
+            putchar('[');
+            for (long i = 0; i < v->length; i++) {
+                printf(i ? " %li" : "%li", (long)v->ints[i]);
+            }
+            putchar(']');
+            break;
+        case LVAL_MAP:
+        case LVAL_SET:
+        case LVAL_SORTED: lval_map_print(v); break;
+        case LVAL_PQ:    lval_pq_print(v); break;
         case LVAL_FUN:
             if (v->builtin) {
                 printf("<BUILTIN>");
@@ -434,6 +1443,8 @@ void lval_println(lval* v) {
 }
 
 lval* lval_pop(lval* v, int i) {
+    if (v->base) { lval_flatten(v); }
+
     /* Find item at i*/
     lval* x = v->cell[i];
 
@@ -443,7 +1454,8 @@ lval* lval_pop(lval* v, int i) {
 
     v->count--;
 
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell = pool_realloc(v->cell,
+        sizeof(lval*) * (v->count+1), sizeof(lval*) * v->count);
 
     return x;
 }
@@ -455,369 +1467,3562 @@ lval* lval_take(lval* v, int i) {
 }
 
 lval* lval_join(lval* x, lval* y) {
-    /* Adds all cells in y to x, deletes y, returns x */
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    /* Adds all cells in y to x, deletes y, returns x. x must be owned */
+    lval_cells(y);
+    for (int i = 0; i < y->count; i++) {
+        x = lval_add(x, lval_ref(y->cell[i]));
     }
     lval_del(y);
     return x;
 }
 
-int lval_eq(lval* x, lval* y) {
-
-    if (x->type != y->type) { return 0; }
+/* Ropes
 
-    switch (x->type) {
-        case LVAL_NUM: return (x->num == y->num);
-        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-        case LVAL_FUN:
-            if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
-            } else {
-                return lval_eq(x->formals, y->formals) &&
-                    lval_eq(x->body, y->body);
-            }
-        /* If it's a list, compare every element within. */
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if (x->count != y->count) { return 0; }
-            for (int i = 0; i < x->count; i++) {
-                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
-            }
-            return 1;
-        default:
-            return 0;
-    }
-}
+   Joining Q-expressions longer than ROPE_LEAF doesn't copy them, it
+   makes a rope node over the two. Ropes are kept balanced like AVL
+   trees, with flat lists and slices as leaves, so join, slicing and
+   finding a cell are all O(log n). Anything that needs a flat cell
+   array flattens the rope in place with lval_cells */
 
-/* Only works on number types! */
-#define ORDERING(op, a, comp) \
-    LASSERT_ARG_NUM(op, a, 2); \
-    LASSERT_TYPE(op, a, 0, LVAL_NUM); \
-    LASSERT_TYPE(op, a, 1, LVAL_NUM); \
-    int r = comp; \
-    lval_del(a); \
-    return lval_num(r)
+#define ROPE_LEAF 32
 
-lval* builtin_leq(lenv* e, lval* a) {
-    ORDERING("<=", a, (a->cell[0]->num <= a->cell[1]->num));
+static inline int lval_height(lval* v) {
+    return lval_is_rope(v) ? v->height : 0;
 }
 
-lval* builtin_geq(lenv* e, lval* a) {
-    ORDERING(">=", a, (a->cell[0]->num >= a->cell[1]->num));
+lval* lval_rope(lval* l, lval* r) {
+    /* Node over l and r, taking ownership of both */
+    lval* v = lval_new(LVAL_QEXPR);
+    v->count = l->count + r->count;
+    v->height = 1 + (lval_height(l) > lval_height(r) ? lval_height(l) : lval_height(r));
+    v->cell = NULL;
+    v->left = l;
+    v->right = r;
+    gc_track(v);
+    return v;
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    ORDERING("<", a, (a->cell[0]->num < a->cell[1]->num));
+lval* lval_rope_balance(lval* l, lval* r) {
+    /* Node over l and r whose heights differ by at most 2,
+    rotated back to a difference of at most 1 */
+    if (lval_height(l) > lval_height(r) + 1) {
+        lval* ll = lval_ref(l->left);
+        lval* lr = lval_ref(l->right);
+        lval_del(l);
+        if (lval_height(ll) >= lval_height(lr)) {
+            return lval_rope(ll, lval_rope(lr, r));
+        }
+        lval* lrl = lval_ref(lr->left);
+        lval* lrr = lval_ref(lr->right);
+        lval_del(lr);
+        return lval_rope(lval_rope(ll, lrl), lval_rope(lrr, r));
+    }
+    if (lval_height(r) > lval_height(l) + 1) {
+        lval* rl = lval_ref(r->left);
+        lval* rr = lval_ref(r->right);
+        lval_del(r);
+        if (lval_height(rr) >= lval_height(rl)) {
+            return lval_rope(lval_rope(l, rl), rr);
+        }
+        lval* rll = lval_ref(rl->left);
+        lval* rlr = lval_ref(rl->right);
+        lval_del(rl);
+        return lval_rope(lval_rope(l, rll), lval_rope(rlr, rr));
+    }
+    return lval_rope(l, r);
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-    ORDERING(">", a, (a->cell[0]->num > a->cell[1]->num));
-}
+lval* lval_concat(lval* l, lval* r) {
+    /* Join two Q-expressions without changing either, taking ownership
+    of both. Short results stay flat lists */
+    if (r->count == 0) { lval_del(r); return l; }
+    if (l->count == 0) { lval_del(l); return r; }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    LASSERT_ARG_NUM("==", a, 2);
-    int r = lval_eq(a->cell[0], a->cell[1]);
-    lval_del(a);
-    return lval_num(r);
-}
+    int dl = lval_height(l);
+    int dr = lval_height(r);
 
-lval* builtin_neq(lenv* e, lval* a) {
-    LASSERT_ARG_NUM("!=", a, 2);
-    int r = !lval_eq(a->cell[0], a->cell[1]);
-    lval_del(a);
-    return lval_num(r);
+    if (dl == 0 && dr == 0) {
+        if (l->count + r->count <= ROPE_LEAF) {
+            return lval_join(lval_own(l), r);
+        }
+        return lval_rope(l, r);
+    }
+
+    /* Go down the inner edge of the taller side until the heights meet.
+    A leaf is always taken all the way down, so short lists end up
+    merged into the neighbouring leaf instead of piling up */
+    if (dl > dr + 1 || (dr == 0 && dl > 0)) {
+        lval* ll = lval_ref(l->left);
+        lval* lr = lval_ref(l->right);
+        lval_del(l);
+        return lval_rope_balance(ll, lval_concat(lr, r));
+    }
+    if (dr > dl + 1 || (dl == 0 && dr > 0)) {
+        lval* rl = lval_ref(r->left);
+        lval* rr = lval_ref(r->right);
+        lval_del(r);
+        return lval_rope_balance(lval_concat(l, rl), rr);
+    }
+    return lval_rope(l, r);
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-    /* Acts like a ternary operator */
-    LASSERT_ARG_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+lval* lval_rope_slice(lval* v, int start, int count) {
+    /* count cells of rope v from start, sharing whatever it can */
+    if (start == 0 && count == v->count) { return v; }
+    if (count == 0) { lval_del(v); return lval_qexpr(); }
 
+    lval* l = v->left;
+    lval* r = v->right;
+    int split = l->count;
     lval* x;
-    /* Mark them as evaluatable */
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
 
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
+    if (start + count <= split) {
+        x = lval_slice(lval_ref(l), start, count);
+    } else if (start >= split) {
+        x = lval_slice(lval_ref(r), start - split, count);
     } else {
-        x = lval_eval(e, lval_pop(a, 2));
+        x = lval_concat(
+            lval_slice(lval_ref(l), start, split - start),
+            lval_slice(lval_ref(r), 0, count - (split - start)));
     }
-
-    lval_del(a);
-
+    lval_del(v);
     return x;
-
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+/* Strings
 
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Cannot operate on non-number!");
-        }
-    }
+   A string knows its length, and its bytes may be shared. A flat one
+   owns len bytes at str and a NUL after them. A view, like substr
+   makes, has sbase set and its bytes are inside sbase's. Joining
+   strings longer than STR_LEAF together makes a rope over the two, with
+   no bytes of its own, balanced like the Q-expression ones so building
+   a long string piece by piece stays linear */
 
-    /* Pop first element */
-    lval* x = lval_pop(a, 0);
+#define STR_LEAF 256
 
-    /* if no arguments and subtraction then perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = x->num;
+void lval_str_fill(lval* v, char* out) {
+    if (!v->sheight) {
+        memcpy(out, v->str, v->len);
+        return;
     }
+    lval_str_fill(v->sleft, out);
+    lval_str_fill(v->sright, out + v->sleft->len);
+}
 
-    /* */
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-        if (y->num == 0) {
-            lval_del(x); lval_del(y);
-            x = lval_err("Division By Zero!"); break;
-            }
-            x->num /= y->num;
-        }
+char* lval_chars(lval* v) {
+    /* The len bytes of string v, NUL terminated only if it is flat. A
+    rope is turned into a flat string in place. Its value stays the
+    same, so this is fine on shared strings too */
+    if (!v->sheight) { return v->str; }
+    char* s = malloc(v->len + 1);
+    lval_str_fill(v, s);
+    s[v->len] = '\0';
+    lval_del(v->sleft);
+    lval_del(v->sright);
+    v->sleft = v->sright = NULL;
+    v->sheight = 0;
+    v->str = s;
+    return s;
+}
 
-        lval_del(y);
-    }
-    lval_del(a);
+char* lval_str_dup(lval* v) {
+    /* Copy of string v for C, to be freed */
+    char* s = malloc(v->len + 1);
+    memcpy(s, lval_chars(v), v->len);
+    s[v->len] = '\0';
+    return s;
+}
 
+lval* lval_str_view(lval* v, long start, long len) {
+    /* len bytes of v from start, sharing them. Takes ownership of v.
+    Views of views share the original bytes */
+    if (start == 0 && len == v->len) { return v; }
+    char* chars = lval_chars(v);
+    lval* x = lval_new(LVAL_STR);
+    x->str = chars + start;
+    x->len = len;
+    x->sbase = lval_ref(v->sbase ? v->sbase : v);
+    x->sright = NULL;
+    x->sheight = 0;
+    lval_del(v);
     return x;
 }
 
-lval* builtin_head(lenv* e, lval* a) {
-    /* Check error conditions */
-    LASSERT(a, a->count == 1,
-        TOO_MANY_ARGUMENTS_EXCEPTION("head", a->count, 1));
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-        WRONG_TYPE_EXCEPTION("head", a->cell[0]->type, 0, ltype_name(LVAL_QEXPR)));
-    LASSERT(a, a->cell[0]->count != 0,
-        EMPTY_LIST_EXCEPTION("head"));
-
-    /* Otherwise take first argument */
-    lval* v = lval_take(a, 0);
-    /* Delete all others */
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-
+lval* lval_str_rope(lval* l, lval* r) {
+    /* Node over l and r, taking ownership of both */
+    lval* v = lval_new(LVAL_STR);
+    v->str = NULL;
+    v->len = l->len + r->len;
+    v->sleft = l;
+    v->sright = r;
+    v->sheight = 1 + (l->sheight > r->sheight ? l->sheight : r->sheight);
     return v;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    /* Check Error Conditions */
-    LASSERT(a, a->count == 1,
-        TOO_MANY_ARGUMENTS_EXCEPTION("tail", a->count, 1));
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-        WRONG_TYPE_EXCEPTION("tail", a->cell[0]->type, 0, ltype_name(LVAL_QEXPR)));
-    LASSERT(a, a->cell[0]->count != 0,
-        EMPTY_LIST_EXCEPTION("tail"));
+lval* lval_str_balance(lval* l, lval* r) {
+    /* lval_rope_balance for strings */
+    if (l->sheight > r->sheight + 1) {
+        lval* ll = lval_ref(l->sleft);
+        lval* lr = lval_ref(l->sright);
+        lval_del(l);
+        if (ll->sheight >= lr->sheight) {
+            return lval_str_rope(ll, lval_str_rope(lr, r));
+        }
+        lval* lrl = lval_ref(lr->sleft);
+        lval* lrr = lval_ref(lr->sright);
+        lval_del(lr);
+        return lval_str_rope(lval_str_rope(ll, lrl), lval_str_rope(lrr, r));
+    }
+    if (r->sheight > l->sheight + 1) {
+        lval* rl = lval_ref(r->sleft);
+        lval* rr = lval_ref(r->sright);
+        lval_del(r);
+        if (rr->sheight >= rl->sheight) {
+            return lval_str_rope(lval_str_rope(l, rl), rr);
+        }
+        lval* rll = lval_ref(rl->sleft);
+        lval* rlr = lval_ref(rl->sright);
+        lval_del(rl);
+        return lval_str_rope(lval_str_rope(l, rll), lval_str_rope(rlr, rr));
+    }
+    return lval_str_rope(l, r);
+}
 
-    /* Take first element, delete pointer to it, return it. */
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
+lval* lval_str_concat(lval* l, lval* r) {
+    /* l followed by r, taking ownership of both. Short results are flat */
+    if (r->len == 0) { lval_del(r); return l; }
+    if (l->len == 0) { lval_del(l); return r; }
+
+    int dl = l->sheight;
+    int dr = r->sheight;
+
+    if (dl == 0 && dr == 0) {
+        if (l->len + r->len > STR_LEAF) { return lval_str_rope(l, r); }
+        char* s = malloc(l->len + r->len + 1);
+        memcpy(s, l->str, l->len);
+        memcpy(s + l->len, r->str, r->len);
+        s[l->len + r->len] = '\0';
+        lval* x = lval_str_own(s, l->len + r->len);
+        lval_del(l);
+        lval_del(r);
+        return x;
+    }
 
-    return v;
+    /* Same as lval_concat: down the inner edge of the taller side */
+    if (dl > dr + 1 || (dr == 0 && dl > 0)) {
+        lval* ll = lval_ref(l->sleft);
+        lval* lr = lval_ref(l->sright);
+        lval_del(l);
+        return lval_str_balance(ll, lval_str_concat(lr, r));
+    }
+    if (dr > dl + 1 || (dl == 0 && dr > 0)) {
+        lval* rl = lval_ref(r->sleft);
+        lval* rr = lval_ref(r->sright);
+        lval_del(r);
+        return lval_str_balance(lval_str_concat(l, rl), rr);
+    }
+    return lval_str_rope(l, r);
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
-}
+/* Hash maps
 
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT(a, a->count == 1,
-        TOO_MANY_ARGUMENTS_EXCEPTION("eval", a->count, 1));
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-        WRONG_TYPE_EXCEPTION("eval", a->cell[0]->type, 0, ltype_name(LVAL_QEXPR)));
+   A map is a hash array mapped trie. Each node looks at 5 more bits of
+   the key's hash and holds, for each value those bits take, either a
+   key with its value (NULL in a set) or, under a NULL key, the next node
+   down. Keys whose 32 bit hashes are all the same end up together in a
+   collision node, which is just searched in order.
+   Like ropes, maps share their nodes: changing one we don't own copies
+   the nodes on the way down and nothing else.
+   A node being changed further down is taken out of its slot until it
+   comes back, or the collector would count the reference twice */
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+#define NODE_BITS 5
+#define NODE_SHIFT_MAX 32
+
+int lval_eq(lval* x, lval* y);
+
+unsigned lval_hash_bytes(unsigned h, const void* p, size_t n) {
+    /* FNV-1a, as for symbols */
+    const unsigned char* c = p;
+    while (n--) { h = (h ^ *c++) * 16777619u; }
+    return h;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v);
+int lval_hash(lval* v, unsigned* h) {
+    /* Folds v into h so that values lval_eq calls equal hash the same.
+    0 if v can't be a key */
+    int t = ltype(v);
+    *h = (*h ^ t) * 16777619u;
+    switch (t) {
+        case LVAL_NUM: {
+            long x = lnum(v);
+            *h = lval_hash_bytes(*h, &x, sizeof(x));
+            return 1;
+        }
+        case LVAL_FLOAT: {
+            /* -0.0 == 0.0 */
+            double x = v->fnum == 0 ? 0 : v->fnum;
+            *h = lval_hash_bytes(*h, &x, sizeof(x));
+            return 1;
+        }
+        case LVAL_BIG:
+            *h = lval_hash_bytes(*h ^ v->negative, v->limbs, sizeof(uint32_t) * v->nlimbs);
+            return 1;
+        case LVAL_STR:
+            *h = lval_hash_bytes(*h, lval_chars(v), v->len);
+            return 1;
+        case LVAL_SYM:
+            *h = (*h ^ v->sym->hash) * 16777619u;
+            return 1;
+        case LVAL_VEC:
+            *h = lval_hash_bytes(*h, v->ints, sizeof(int64_t) * v->length);
+            return 1;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            lval_cells(v);
+            for (int i = 0; i < v->count; i++) {
+                if (!lval_hash(v->cell[i], h)) { return 0; }
+            }
+            *h = (*h ^ v->count) * 16777619u;
+            return 1;
+        default:
+            return 0;
+    }
+}
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+int lval_key_hash(lval* k, unsigned* h) {
+    *h = 2166136261u;
+    if (!lval_hash(k, h)) { return 0; }
+    /* Every bit gets used, so stir them all */
+    *h ^= *h >> 16;
+    *h *= 0x85ebca6bu;
+    *h ^= *h >> 13;
+    *h *= 0xc2b2ae35u;
+    *h ^= *h >> 16;
+    return 1;
+}
 
-    /* If it's builtin, simply call it */
-    if (f->builtin) { return f->builtin(e, a); }
+static inline int lval_node_pos(lval* n, uint32_t bit) {
+    return __builtin_popcount(n->bitmap & (bit - 1));
+}
 
-    int given = a->count;
-    int total = f->formals->count;
+int lval_is_ordered(lval* k);
 
-    while (a->count) {
+int lval_key_ok(lval* m, lval* k, unsigned* h) {
+    /* Whether k can be a key of m, hashing it into h if m hashes keys */
+    return m->type == LVAL_SORTED ? lval_is_ordered(k) : lval_key_hash(k, h);
+}
 
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err(TOO_MANY_ARGUMENTS_EXCEPTION("<lambda>", given, total));
+lval** lval_tree_find(lval* m, lval* k);
+
+lval** lval_map_find(lval* m, lval* k, unsigned h) {
+    /* The cell holding k's value (NULL in a set) for k, which hashes to
+    h. NULL if k isn't in m at all */
+    if (m->type == LVAL_SORTED) { return lval_tree_find(m, k); }
+    lval* n = m->root;
+    for (int shift = 0; n; shift += NODE_BITS) {
+        if (shift >= NODE_SHIFT_MAX) {
+            for (int i = 0; i < n->width; i++) {
+                if (lval_eq(n->kv[2*i], k)) { return &n->kv[2*i + 1]; }
+            }
+            return NULL;
         }
+        uint32_t bit = 1u << ((h >> shift) & 31);
+        if (!(n->bitmap & bit)) { return NULL; }
+        lval** kv = &n->kv[2 * lval_node_pos(n, bit)];
+        if (kv[0]) { return lval_eq(kv[0], k) ? &kv[1] : NULL; }
+        n = kv[1];
+    }
+    return NULL;
+}
 
-        lval* sym = lval_pop(f->formals, 0);
+lval* lval_node_own(lval* n) {
+    /* Copy on write, as lval_own */
+    if (n->refs == 1) { return n; }
+    lval* x = lval_node(n->bitmap, n->width);
+    for (int i = 0; i < 2 * n->width; i++) {
+        if (n->kv[i]) { x->kv[i] = lval_ref(n->kv[i]); }
+    }
+    n->refs--;
+    return x;
+}
 
-        /* Special case: list after & symbol. Same as ... in c kinda */
-        if (strcmp(sym->sym, "&") == 0) {
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("Function format invalid. "
-                "Symbol '&' Not followed by single symbol.");
-            }
-            /* Next symbol is a builtin list of all extra arguments */
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
+lval* lval_node_insert(lval* n, int i, uint32_t bit, lval* k, lval* v) {
+    /* n with k and v as its new entry i. Takes n, k and v */
+    if (n->refs == 1) {
+        n->kv = pool_realloc(n->kv,
+            sizeof(lval*) * 2 * n->width, sizeof(lval*) * 2 * (n->width + 1));
+        memmove(&n->kv[2*i + 2], &n->kv[2*i], sizeof(lval*) * 2 * (n->width - i));
+        n->width++;
+    } else {
+        lval* x = lval_node(n->bitmap, n->width + 1);
+        for (int j = 0; j < 2 * n->width; j++) {
+            if (n->kv[j]) { x->kv[j < 2*i ? j : j + 2] = lval_ref(n->kv[j]); }
         }
+        lval_del(n);
+        n = x;
+    }
+    n->bitmap |= bit;
+    n->kv[2*i] = k;
+    n->kv[2*i + 1] = v;
+    return n;
+}
 
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
+lval* lval_node_put(lval* n, int shift, lval* k, unsigned h, lval* v, int* added) {
+    /* Trie n, or an empty one if NULL, with k set to v. k hashes to h.
+    Takes n, k and v, and sets added if k is new */
+    if (shift >= NODE_SHIFT_MAX) {
+        if (n) {
+            for (int i = 0; i < n->width; i++) {
+                if (!lval_eq(n->kv[2*i], k)) { continue; }
+                n = lval_node_own(n);
+                lval_del(k);
+                if (n->kv[2*i + 1]) { lval_del(n->kv[2*i + 1]); }
+                n->kv[2*i + 1] = v;
+                return n;
+            }
+        }
+        *added = 1;
+        return n ? lval_node_insert(n, n->width, 0, k, v)
+            : lval_node_insert(lval_node(0, 0), 0, 0, k, v);
+    }
 
-        lval_del(sym);
-        lval_del(val);
+    uint32_t bit = 1u << ((h >> shift) & 31);
+    if (!n) { n = lval_node(0, 0); }
+    int i = lval_node_pos(n, bit);
+    if (!(n->bitmap & bit)) {
+        *added = 1;
+        return lval_node_insert(n, i, bit, k, v);
     }
 
-    lval_del(a);
+    n = lval_node_own(n);
+    lval** kv = &n->kv[2*i];
+    if (!kv[0]) {
+        lval* down = kv[1];
+        kv[1] = NULL;
+        kv[1] = lval_node_put(down, shift + NODE_BITS, k, h, v, added);
+    } else if (lval_eq(kv[0], k)) {
+        lval_del(k);
+        if (kv[1]) { lval_del(kv[1]); }
+        kv[1] = v;
+    } else {
+        /* Two keys want this spot, so they both go one node down */
+        lval* old_key = kv[0];
+        lval* old_val = kv[1];
+        unsigned old_hash;
+        int moved;
+        kv[0] = kv[1] = NULL;
+        lval_key_hash(old_key, &old_hash);
+        lval* down = lval_node_put(NULL, shift + NODE_BITS, old_key, old_hash, old_val, &moved);
+        kv[1] = lval_node_put(down, shift + NODE_BITS, k, h, v, added);
+    }
+    return n;
+}
 
-    /* If '&' remains in formal list, bind to empty list {} */
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+lval* lval_node_remove(lval* n, int shift, lval* k, unsigned h) {
+    /* Trie n without k, which hashes to h and must be in it.
+    Takes n. NULL if that leaves it empty */
+    int i = 0;
+    uint32_t bit = 0;
+    if (shift >= NODE_SHIFT_MAX) {
+        while (!lval_eq(n->kv[2*i], k)) { i++; }
+    } else {
+        bit = 1u << ((h >> shift) & 31);
+        i = lval_node_pos(n, bit);
+    }
 
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid. "
-                "Symbol '&' not followed by single symbol.");
+    n = lval_node_own(n);
+    lval** kv = &n->kv[2*i];
+    if (!kv[0]) {
+        lval* down = kv[1];
+        kv[1] = NULL;
+        down = lval_node_remove(down, shift + NODE_BITS, k, h);
+        /* A node down to one key gives it back up here */
+        if (down && down->width == 1 && down->kv[0]) {
+            kv[0] = lval_ref(down->kv[0]);
+            kv[1] = down->kv[1] ? lval_ref(down->kv[1]) : NULL;
+            lval_del(down);
+            return n;
         }
+        kv[1] = down;
+        if (down) { return n; }
+    } else {
+        lval_del(kv[0]);
+        if (kv[1]) { lval_del(kv[1]); }
+    }
 
-        /* Pop and delete & */
-        lval_del(lval_pop(f->formals, 0));
+    if (n->width == 1) {
+        n->kv[0] = n->kv[1] = NULL;
+        lval_del(n);
+        return NULL;
+    }
+    memmove(&n->kv[2*i], &n->kv[2*i + 2], sizeof(lval*) * 2 * (n->width - i - 1));
+    n->kv = pool_realloc(n->kv,
+        sizeof(lval*) * 2 * n->width, sizeof(lval*) * 2 * (n->width - 1));
+    n->width--;
+    n->bitmap &= ~bit;
+    return n;
+}
 
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
+lval* lval_tree_put(lval* root, lval* k, lval* v, int* added);
+lval* lval_tree_remove(lval* root, lval* k);
 
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+lval* lval_map_key(lval* k) {
+    /* k as it's kept in a map. Takes k. A view would keep all of the
+    string it came from alive */
+    if (ltype(k) == LVAL_STR && k->sbase && !k->sheight) {
+        lval* x = lval_copy(k);
+        lval_del(k);
+        k = x;
     }
+    return k;
+}
 
-    /* If all formals have been bound, evaluate */
-    if (f->formals->count == 0) {
-        f->env->parent = e;
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    }
-    /* Else return a copy of itself with some argumets filled */
-    return lval_copy(f);
+void lval_map_put(lval* m, lval* k, unsigned h, lval* v) {
+    /* Sets key k, hashing to h, to v in m, which must be ours.
+    Takes k and v. v is NULL for a set */
+    int added = 0;
+    k = lval_map_key(k);
+    lval* root = m->root;
+    m->root = NULL;
+    m->root = m->type == LVAL_SORTED ? lval_tree_put(root, k, v, &added)
+        : lval_node_put(root, 0, k, h, v, &added);
+    m->mcount += added;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-            WRONG_TYPE_EXCEPTION(
-                "join", a->cell[i]->type, i, ltype_name(LVAL_QEXPR)));
+void lval_map_remove(lval* m, lval* k, unsigned h) {
+    /* Takes k, hashing to h, out of m, which must be ours */
+    if (!lval_map_find(m, k, h)) { return; }
+    lval* root = m->root;
+    m->root = NULL;
+    m->root = m->type == LVAL_SORTED ? lval_tree_remove(root, k)
+        : lval_node_remove(root, 0, k, h);
+    m->mcount--;
+}
+
+int lval_node_fill(lval* n, lval** keys, lval** vals, int count) {
+    /* Adds the entries under n to keys and vals, either of which may be
+    NULL, without references. Returns the count after */
+    for (int i = 0; i < n->width; i++) {
+        if (!n->kv[2*i]) {
+            count = lval_node_fill(n->kv[2*i + 1], keys, vals, count);
+            continue;
+        }
+        if (keys) { keys[count] = n->kv[2*i]; }
+        if (vals) { vals[count] = n->kv[2*i + 1]; }
+        count++;
     }
+    return count;
+}
 
-    lval* x = lval_pop(a, 0);
+int lval_tnode_fill(lval* n, lval** keys, lval** vals, int count);
 
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
-    }
-    lval_del(a);
-    return x;
+void lval_map_fill(lval* m, lval** keys, lval** vals) {
+    /* m's keys and values into keys and vals, either of which may be
+    NULL, without references. In key order for a sorted map */
+    if (!m->root) { return; }
+    if (m->type == LVAL_SORTED) { lval_tnode_fill(m->root, keys, vals, 0); }
+    else { lval_node_fill(m->root, keys, vals, 0); }
 }
 
-lval* builtin_len(lenv* e, lval* a) {
-    LASSERT(a, a->count == 1,
-        TOO_MANY_ARGUMENTS_EXCEPTION("len", a->count, 1));
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-        WRONG_TYPE_EXCEPTION("len", a->cell[0]->type, 0, ltype_name(LVAL_QEXPR)));
+lval** lval_map_entries(lval* m, lval*** vals) {
+    /* Arrays of m's keys and, if vals isn't NULL, values. The caller
+    frees them, they hold no references */
+    long n = m->mcount ? m->mcount : 1;
+    lval** keys = malloc(sizeof(lval*) * n);
+    if (vals) { *vals = malloc(sizeof(lval*) * n); }
+    lval_map_fill(m, keys, vals ? *vals : NULL);
+    return keys;
+}
 
-    lval* x = lval_take(a, 0);
+int lval_eq(lval* x, lval* y) {
 
-    return lval_num(x->count);
+    if (ltype(x) != ltype(y)) { return 0; }
+
+    switch (ltype(x)) {
+        case LVAL_NUM: return (lnum(x) == lnum(y));
+        case LVAL_FLOAT: return x->fnum == y->fnum;
+        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+        case LVAL_SYM: return (x->sym == y->sym);
+        case LVAL_STR:
+            return x->len == y->len && memcmp(lval_chars(x), lval_chars(y), x->len) == 0;
+        case LVAL_VEC:
+            return x->length == y->length
+                && memcmp(x->ints, y->ints, sizeof(int64_t) * x->length) == 0;
+        case LVAL_BIG:
+            return x->negative == y->negative && x->nlimbs == y->nlimbs
+                && memcmp(x->limbs, y->limbs, sizeof(uint32_t) * x->nlimbs) == 0;
+        case LVAL_FUN:
+            if (x->builtin || y->builtin) {
+                return x->builtin == y->builtin;
+            } else {
+                return lval_eq(x->formals, y->formals) &&
+                    lval_eq(x->body, y->body);
+            }
+        /* If it's a list, compare every element within. */
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (x->count != y->count) { return 0; }
+            lval_cells(x);
+            lval_cells(y);
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+            }
+            return 1;
+        /* Same entries, whatever the shape of the tries */
+        case LVAL_MAP:
+        case LVAL_SET:
+        case LVAL_SORTED: {
+            if (x->mcount != y->mcount) { return 0; }
+            if (x->root == y->root) { return 1; }
+            lval** vals;
+            lval** keys = lval_map_entries(x, &vals);
+            int eq = 1;
+            for (long i = 0; i < x->mcount && eq; i++) {
+                unsigned h;
+                lval_key_ok(y, keys[i], &h);
+                lval** val = lval_map_find(y, keys[i], h);
+                eq = val && (x->type == LVAL_SET || lval_eq(vals[i], *val));
+            }
+            free(keys);
+            free(vals);
+            return eq;
+        }
+        /* Same items in the same places, which copies of a queue and
+        queues built the same way have */
+        case LVAL_PQ:
+            if (x->hsize != y->hsize) { return 0; }
+            if (!x->horder != !y->horder || (x->horder && !lval_eq(x->horder, y->horder))) {
+                return 0;
+            }
+            return !x->hroot || lval_eq(x->hroot, y->hroot);
+        case LVAL_HNODE:
+            return lval_eq(x->hitem, y->hitem)
+                && !x->hleft == !y->hleft && (!x->hleft || lval_eq(x->hleft, y->hleft))
+                && !x->hright == !y->hright && (!x->hright || lval_eq(x->hright, y->hright));
+        default:
+            return 0;
+    }
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+/* Only works on number types! */
+/* Big numbers
+
+   Numbers that don't fit a long. + - * / check for overflow and start
+   over with big numbers when it happens, and a result that fits again
+   goes back to being a plain number, so a big number is never small.
+   The magnitude is 32 bit limbs, least significant first, with no
+   leading zeros; the mag_ functions work on those */
+
+#define KARATSUBA_THRESHOLD 32
+
+lval* lval_big(int n) {
+    /* Zero, with room for n limbs */
+    lval* v = lval_new(LVAL_BIG);
+    v->limbs = calloc(n ? n : 1, sizeof(uint32_t));
+    v->nlimbs = n;
+    v->negative = 0;
+    return v;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+int mag_len(const uint32_t* a, int n) {
+    while (n > 0 && a[n-1] == 0) { n--; }
+    return n;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+int mag_cmp(const uint32_t* a, int an, const uint32_t* b, int bn) {
+    an = mag_len(a, an);
+    bn = mag_len(b, bn);
+    if (an != bn) { return an < bn ? -1 : 1; }
+    for (int i = an - 1; i >= 0; i--) {
+        if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+    }
+    return 0;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+uint32_t mag_add_to(uint32_t* r, int rn, const uint32_t* x, int xn) {
+    /* r += x for xn <= rn, returning what carries out of r */
+    uint64_t carry = 0;
+    int i = 0;
+    for (; i < xn; i++) {
+        carry += (uint64_t)r[i] + x[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (; carry && i < rn; i++) {
+        carry += r[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return (uint32_t)carry;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
+uint32_t mag_sub_from(uint32_t* r, int rn, const uint32_t* x, int xn) {
+    /* r -= x for xn <= rn, returning what borrows out of r */
+    uint32_t borrow = 0;
+    int i = 0;
+    for (; i < xn; i++) {
+        uint64_t d = (uint64_t)r[i] - x[i] - borrow;
+        r[i] = (uint32_t)d;
+        borrow = (d >> 32) != 0;
+    }
+    for (; borrow && i < rn; i++) {
+        borrow = r[i] == 0;
+        r[i]--;
+    }
+    return borrow;
+}
 
-    LASSERT_ARG_NUM("lambda", a, 2);
-    LASSERT_TYPE("lambda", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("lambda", a, 1, LVAL_QEXPR);
+void mag_mul_school(uint32_t* r, const uint32_t* a, int an, const uint32_t* b, int bn) {
+    memset(r, 0, sizeof(uint32_t) * (an + bn));
+    for (int i = 0; i < an; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < bn; j++) {
+            carry += (uint64_t)a[i] * b[j] + r[i+j];
+            r[i+j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i+bn] = (uint32_t)carry;
+    }
+}
 
-    /* Ensure first QEXPR only contains symbols */
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-            "Cannot define non-symbol. Got %s, expected %s",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+void mag_mul(uint32_t* r, const uint32_t* a, int an, const uint32_t* b, int bn) {
+    /* r = a * b, where r has room for an + bn limbs */
+    if (an < bn) {
+        const uint32_t* t = a; a = b; b = t;
+        int tn = an; an = bn; bn = tn;
+    }
+    if (bn < KARATSUBA_THRESHOLD) {
+        mag_mul_school(r, a, an, b, bn);
+        return;
     }
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
+    /* Lopsided: b times pieces of a as long as b */
+    if (an >= 2 * bn) {
+        uint32_t* t = malloc(sizeof(uint32_t) * 2 * bn);
+        memset(r, 0, sizeof(uint32_t) * (an + bn));
+        for (int i = 0; i < an; i += bn) {
+            int n = an - i < bn ? an - i : bn;
+            mag_mul(t, a + i, n, b, bn);
+            mag_add_to(r + i, an + bn - i, t, n + bn);
+        }
+        free(t);
+        return;
+    }
 
-    return lval_lambda(formals, body);
+    /* Karatsuba. With a = a1 B^m + a0 and b = b1 B^m + b0,
+    a b = a1 b1 B^2m + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B^m + a0 b0,
+    three multiplications of half the size instead of four */
+    int m = an / 2;
+    mag_mul(r, a, m, b, m);
+    mag_mul(r + 2*m, a + m, an - m, b + m, bn - m);
+
+    int sn = an - m + 1;
+    int tn = (bn - m > m ? bn - m : m) + 1;
+    uint32_t* s = calloc(sn + tn + sn + tn, sizeof(uint32_t));
+    uint32_t* t = s + sn;
+    uint32_t* z = t + tn;
+    memcpy(s, a + m, sizeof(uint32_t) * (an - m));
+    mag_add_to(s, sn, a, m);
+    memcpy(t, b, sizeof(uint32_t) * m);
+    mag_add_to(t, tn, b + m, bn - m);
+
+    mag_mul(z, s, sn, t, tn);
+    mag_sub_from(z, sn + tn, r, 2*m);
+    mag_sub_from(z, sn + tn, r + 2*m, an + bn - 2*m);
+    mag_add_to(r + m, an + bn - m, z, mag_len(z, sn + tn));
+    free(s);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+uint32_t mag_div_small(uint32_t* q, const uint32_t* a, int an, uint32_t d) {
+    /* q = a / d, returning the remainder. q may be a */
+    uint64_t rem = 0;
+    for (int i = an - 1; i >= 0; i--) {
+        uint64_t cur = (rem << 32) | a[i];
+        q[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    return (uint32_t)rem;
+}
+
+void mag_div(uint32_t* q, const uint32_t* a, int an, const uint32_t* b, int bn) {
+    /* q = a / b for an >= bn >= 2, where q has room for an - bn + 1 limbs.
+    Long division as in Knuth's algorithm D: b is shifted so its top bit
+    is set, which makes guessing each limb of q from the top two limbs
+    of what is left off by at most 2 */
+    int shift = __builtin_clz(b[bn-1]);
+    uint32_t* v = malloc(sizeof(uint32_t) * bn);
+    uint32_t* u = malloc(sizeof(uint32_t) * (an + 1));
+    for (int i = bn - 1; i > 0; i--) {
+        v[i] = (b[i] << shift) | (shift ? b[i-1] >> (32 - shift) : 0);
+    }
+    v[0] = b[0] << shift;
+    u[an] = shift ? a[an-1] >> (32 - shift) : 0;
+    for (int i = an - 1; i > 0; i--) {
+        u[i] = (a[i] << shift) | (shift ? a[i-1] >> (32 - shift) : 0);
+    }
+    u[0] = a[0] << shift;
+
+    for (int j = an - bn; j >= 0; j--) {
+        uint64_t top = ((uint64_t)u[j+bn] << 32) | u[j+bn-1];
+        uint64_t guess = top / v[bn-1];
+        uint64_t rem = top % v[bn-1];
+        while (guess >> 32 || guess * v[bn-2] > ((rem << 32) | u[j+bn-2])) {
+            guess--;
+            rem += v[bn-1];
+            if (rem >> 32) { break; }
+        }
+
+        /* u -= guess * v, at j */
+        uint64_t carry = 0;
+        uint32_t borrow = 0;
+        for (int i = 0; i < bn; i++) {
+            uint64_t p = guess * v[i] + carry;
+            carry = p >> 32;
+            uint64_t d = (uint64_t)u[i+j] - (uint32_t)p - borrow;
+            u[i+j] = (uint32_t)d;
+            borrow = (d >> 32) != 0;
+        }
+        uint64_t d = (uint64_t)u[j+bn] - carry - borrow;
+        u[j+bn] = (uint32_t)d;
+
+        /* Went below zero, so guess was one too many */
+        if (d >> 32) {
+            guess--;
+            u[j+bn] += mag_add_to(u + j, bn, v, bn);
+        }
+        q[j] = (uint32_t)guess;
+    }
+    free(u);
+    free(v);
+}
+
+lval* lval_big_of(lval* x) {
+    /* Number x as a big number, even if it is small */
+    if (ltype(x) == LVAL_BIG) { return lval_ref(x); }
+    long n = lnum(x);
+    uint64_t m = n < 0 ? 0 - (uint64_t)n : (uint64_t)n;
+    lval* v = lval_big(2);
+    v->limbs[0] = (uint32_t)m;
+    v->limbs[1] = (uint32_t)(m >> 32);
+    v->nlimbs = mag_len(v->limbs, 2);
+    v->negative = n < 0;
+    return v;
+}
+
+lval* lval_big_norm(lval* v) {
+    /* Tidies up a new big number v, which becomes a plain one if it fits */
+    v->nlimbs = mag_len(v->limbs, v->nlimbs);
+    if (v->nlimbs == 0) { v->negative = 0; }
+    if (v->nlimbs > 2) { return v; }
+
+    uint64_t m = 0;
+    for (int i = v->nlimbs - 1; i >= 0; i--) { m = (m << 32) | v->limbs[i]; }
+    if (m <= (uint64_t)LONG_MAX || (v->negative && m - 1 <= (uint64_t)LONG_MAX)) {
+        long n = v->negative ? -(long)(m - 1) - 1 : (long)m;
+        lval_del(v);
+        return lval_num(n);
+    }
+    return v;
+}
+
+lval* lval_big_add(lval* x, lval* y, int negate) {
+    /* x + y, or x - y with negate */
+    int yneg = y->negative ^ negate;
+    if (x->negative == yneg) {
+        int n = (x->nlimbs > y->nlimbs ? x->nlimbs : y->nlimbs) + 1;
+        lval* r = lval_big(n);
+        memcpy(r->limbs, x->limbs, sizeof(uint32_t) * x->nlimbs);
+        mag_add_to(r->limbs, n, y->limbs, y->nlimbs);
+        r->negative = yneg;
+        return r;
+    }
+
+    /* Different signs: the smaller one comes off the bigger one */
+    int bigger = mag_cmp(x->limbs, x->nlimbs, y->limbs, y->nlimbs) >= 0;
+    lval* l = bigger ? x : y;
+    lval* s = bigger ? y : x;
+    lval* r = lval_big(l->nlimbs);
+    memcpy(r->limbs, l->limbs, sizeof(uint32_t) * l->nlimbs);
+    mag_sub_from(r->limbs, l->nlimbs, s->limbs, s->nlimbs);
+    r->negative = bigger ? x->negative : yneg;
+    return r;
+}
+
+lval* lval_big_mul(lval* x, lval* y) {
+    lval* r = lval_big(x->nlimbs + y->nlimbs);
+    mag_mul(r->limbs, x->limbs, x->nlimbs, y->limbs, y->nlimbs);
+    r->negative = x->negative ^ y->negative;
+    return r;
+}
+
+lval* lval_big_div(lval* x, lval* y) {
+    /* Rounds towards zero, like / on plain numbers. y isn't zero */
+    if (mag_cmp(x->limbs, x->nlimbs, y->limbs, y->nlimbs) < 0) { return lval_big(0); }
+    lval* r = lval_big(x->nlimbs - y->nlimbs + 1);
+    if (y->nlimbs == 1) {
+        mag_div_small(r->limbs, x->limbs, x->nlimbs, y->limbs[0]);
+    } else {
+        mag_div(r->limbs, x->limbs, x->nlimbs, y->limbs, y->nlimbs);
+    }
+    r->negative = x->negative ^ y->negative;
+    return r;
+}
+
+int lval_big_args(lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        if (ltype(a->cell[i]) == LVAL_BIG) { return 1; }
+    }
+    return 0;
+}
+
+lval* lval_big_op(lval* a, char* op) {
+    /* builtin_op once plain numbers aren't enough. a is all numbers */
+    lval* x = lval_big_of(a->cell[0]);
+    if ((strcmp(op, "-") == 0) && a->count == 1) {
+        lval* y = lval_copy(x);
+        y->negative = !y->negative;
+        lval_del(x);
+        x = y;
+    }
+
+    for (int i = 1; i < a->count; i++) {
+        lval* y = lval_big_of(a->cell[i]);
+        lval* r;
+        if (strcmp(op, "+") == 0) { r = lval_big_add(x, y, 0); }
+        else if (strcmp(op, "-") == 0) { r = lval_big_add(x, y, 1); }
+        else if (strcmp(op, "*") == 0) { r = lval_big_mul(x, y); }
+        else if (y->nlimbs == 0) { r = lval_err("Division By Zero!"); }
+        else { r = lval_big_div(x, y); }
+        lval_del(x);
+        lval_del(y);
+        x = r;
+        if (ltype(x) == LVAL_ERR) { break; }
+    }
+    lval_del(a);
+    return ltype(x) == LVAL_ERR ? x : lval_big_norm(x);
+}
+
+int lval_big_cmp(lval* x, lval* y) {
+    /* -1, 0 or 1 as number x is less than, equal to or more than y */
+    lval* bx = lval_big_of(x);
+    lval* by = lval_big_of(y);
+    int c;
+    if (bx->negative != by->negative) {
+        c = bx->negative ? -1 : 1;
+    } else {
+        c = mag_cmp(bx->limbs, bx->nlimbs, by->limbs, by->nlimbs);
+        if (bx->negative) { c = -c; }
+    }
+    lval_del(bx);
+    lval_del(by);
+    return c;
+}
+
+char* lval_big_str(lval* v) {
+    /* Decimal digits of v, to be freed. Dividing by 10^9 gives nine
+    digits at a time from one pass over the limbs */
+    int n = v->nlimbs;
+    uint32_t* m = malloc(sizeof(uint32_t) * (n ? n : 1));
+    memcpy(m, v->limbs, sizeof(uint32_t) * n);
+    uint32_t* chunks = malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+    int count = 0;
+    do {
+        chunks[count++] = mag_div_small(m, m, n, 1000000000);
+        n = mag_len(m, n);
+    } while (n > 0);
+
+    char* s = malloc(count * 9 + 2);
+    char* p = s;
+    if (v->negative) { *p++ = '-'; }
+    p += sprintf(p, "%u", (unsigned)chunks[count-1]);
+    for (int i = count - 2; i >= 0; i--) { p += sprintf(p, "%09u", (unsigned)chunks[i]); }
+    free(chunks);
+    free(m);
+    return s;
+}
+
+lval* lval_big_read(char* s) {
+    /* Number literal too long for strtol */
+    int negative = *s == '-';
+    if (negative) { s++; }
+    int digits = strlen(s);
+    lval* v = lval_big(digits / 9 + 1);
+    int n = 0;
+
+    /* v = v * 10^k + the next k digits, with k = 9 after the first */
+    for (int i = 0, k = digits % 9 ? digits % 9 : 9; i < digits; k = 9) {
+        uint32_t chunk = 0, scale = 1;
+        for (; k > 0; k--, i++) {
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        uint64_t carry = chunk;
+        for (int j = 0; j < n; j++) {
+            carry += (uint64_t)v->limbs[j] * scale;
+            v->limbs[j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry) { v->limbs[n++] = (uint32_t)carry; }
+    }
+    v->nlimbs = n;
+    v->negative = negative;
+    return lval_big_norm(v);
+}
+
+/* Floats
+
+   Doubles, written with a point or an exponent. Arithmetic or ordering
+   with a float among the numbers is done in floats. == still compares
+   values as they are, so 1 and 1.0 aren't equal */
+
+double lval_to_double(lval* x) {
+    /* Any number as a double */
+    switch (ltype(x)) {
+        case LVAL_FLOAT: return x->fnum;
+        case LVAL_NUM: return (double)lnum(x);
+        default: {
+            double d = 0;
+            for (int i = x->nlimbs - 1; i >= 0; i--) { d = d * 4294967296.0 + x->limbs[i]; }
+            return x->negative ? -d : d;
+        }
+    }
+}
+
+void lval_float_str(char* buf, size_t size, double x) {
+    /* Shortest form that reads back as the same float. Starting from 1
+    digit matters for denormals, which have fewer than 15 to give */
+    for (int digits = 1; digits <= 17; digits++) {
+        snprintf(buf, size, "%.*g", digits, x);
+        if (strtod(buf, NULL) == x) { break; }
+    }
+    /* %g goes to an exponent once there are more places than digits.
+    Below 1e15 keep writing them out, as 100.0 rather than 1e+02 */
+    char* exp = strchr(buf, 'e');
+    if (exp && atoi(exp + 1) >= 0 && atoi(exp + 1) < 15) { snprintf(buf, size, "%.0f", x); }
+    /* Whole numbers get a point, so they stay floats */
+    if (!strpbrk(buf, ".enia")) { strncat(buf, ".0", size - strlen(buf) - 1); }
+}
+
+lval* lval_float_op(lval* a, char* op, int mixed) {
+    /* builtin_op with floats. If it is mixed with other numbers they
+    become floats too, otherwise they are read without checking */
+    char o = op[0];
+    double x = mixed ? lval_to_double(a->cell[0]) : a->cell[0]->fnum;
+    if (o == '-' && a->count == 1) { x = -x; }
+
+    for (int i = 1; i < a->count; i++) {
+        double y = mixed ? lval_to_double(a->cell[i]) : a->cell[i]->fnum;
+        if (o == '+') { x += y; }
+        else if (o == '-') { x -= y; }
+        else if (o == '*') { x *= y; }
+        else {
+            if (y == 0) {
+                lval_del(a);
+                return lval_err("Division By Zero!");
+            }
+            x /= y;
+        }
+    }
+    lval_del(a);
+    return lval_float(x);
+}
+
+lval* lval_from_double(double x) {
+    /* Whole number x as a plain or big number */
+    if (x >= -9.2e18 && x <= 9.2e18) { return lval_num((long)x); }
+    int e;
+    frexp(x, &e);
+    lval* v = lval_big((e + 31) / 32);
+    double m = fabs(x);
+    for (int i = v->nlimbs - 1; i >= 0; i--) {
+        double limb = floor(ldexp(m, -32 * i));
+        v->limbs[i] = (uint32_t)limb;
+        m -= ldexp(limb, 32 * i);
+    }
+    v->negative = x < 0;
+    return lval_big_norm(v);
+}
+
+lval* lval_math(lval* a, char* func) {
+    /* The one argument to func, which can be any number, as a double */
+    LASSERT_ARG_NUM(func, a, 1);
+    int t = ltype(a->cell[0]);
+    LASSERT(a, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLOAT,
+        "Function '%s' passed incorrect type for argument 0. Got %s, Expected Number.",
+        func, ltype_name(t));
+    return a;
+}
+
+lval* builtin_sqrt(lenv* e, lval* a) {
+    a = lval_math(a, "sqrt");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    double x = lval_to_double(a->cell[0]);
+    LASSERT(a, x >= 0, "Function 'sqrt' passed a negative number.");
+    lval_del(a);
+    return lval_float(sqrt(x));
+}
+
+lval* builtin_exp(lenv* e, lval* a) {
+    a = lval_math(a, "exp");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    double x = lval_to_double(a->cell[0]);
+    lval_del(a);
+    return lval_float(exp(x));
+}
+
+lval* builtin_log(lenv* e, lval* a) {
+    a = lval_math(a, "log");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    double x = lval_to_double(a->cell[0]);
+    LASSERT(a, x > 0, "Function 'log' passed a number that isn't positive.");
+    lval_del(a);
+    return lval_float(log(x));
+}
+
+lval* builtin_floor(lenv* e, lval* a) {
+    /* Largest whole number not above the argument, as a number */
+    a = lval_math(a, "floor");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    if (ltype(a->cell[0]) != LVAL_FLOAT) { return lval_take(a, 0); }
+    double x = a->cell[0]->fnum;
+    LASSERT(a, isfinite(x), "Function 'floor' passed %f.", x);
+    lval_del(a);
+    return lval_from_double(floor(x));
+}
+
+/* Vectors
+
+   Numbers in one int64_t array, for working on lots of them at once.
+   + - * and < > <= >= go elementwise when given vectors, with plain
+   numbers standing in for a vector full of them; comparisons give 0/1
+   masks. Arithmetic wraps around like it does on numbers. The loops
+   are done 4 at a time with AVX2 when the CPU has it, 2 at a time with
+   SSE2 where that has the instructions, and one at a time otherwise */
+
+enum { VEC_ADD, VEC_SUB, VEC_MUL, VEC_LT, VEC_GT, VEC_LE, VEC_GE };
+
+/* Longest vector, 2 GiB of numbers */
+#define VEC_MAX (1L << 28)
+
+lval* lval_vec(long length) {
+    /* An error instead if there's no room for it */
+    if (length > VEC_MAX) {
+        return lval_err("Vector of %li numbers is too long. Expected at most %li.",
+            length, VEC_MAX);
+    }
+    int64_t* ints = malloc(sizeof(int64_t) * (length ? length : 1));
+    if (!ints) { return lval_err("Out of memory for a vector of %li numbers.", length); }
+    lval* v = lval_new(LVAL_VEC);
+    v->length = length;
+    v->ints = ints;
+    return v;
+}
+
+static inline int64_t vec_op1(int op, int64_t x, int64_t y) {
+    switch (op) {
+        case VEC_ADD: return (int64_t)((uint64_t)x + (uint64_t)y);
+        case VEC_SUB: return (int64_t)((uint64_t)x - (uint64_t)y);
+        case VEC_MUL: return (int64_t)((uint64_t)x * (uint64_t)y);
+        case VEC_LT: return x < y;
+        case VEC_GT: return x > y;
+        case VEC_LE: return x <= y;
+        default: return x >= y;
+    }
+}
+
+#ifdef TYSON_SIMD
+
+int vec_avx2(void) {
+    static int has = -1;
+    if (has == -1) { has = __builtin_cpu_supports("avx2"); }
+    return has;
+}
+
+/* Low 64 bits of a product, out of 32 bit multiplies */
+__attribute__((target("avx2")))
+static inline __m256i vec_mul_avx2(__m256i a, __m256i b) {
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
+
+static inline __m128i vec_mul_sse2(__m128i a, __m128i b) {
+    __m128i cross = _mm_add_epi64(
+        _mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+        _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
+
+/* out = x op y over n. A NULL x or y stands for xs or ys everywhere */
+#define VEC_LOOP(W, T, LOAD, SET1, STORE, EXPR) \
+    for (; i + W <= n; i += W) { \
+        T a = x ? LOAD((const T*)(x + i)) : SET1(xs); \
+        T b = y ? LOAD((const T*)(y + i)) : SET1(ys); \
+        STORE((T*)(out + i), EXPR); \
+    }
+
+__attribute__((target("avx2")))
+static long vec_kernel_avx2(int op, int64_t* out, int64_t* x, int64_t xs,
+                            int64_t* y, int64_t ys, long n) {
+    __m256i one = _mm256_set1_epi64x(1);
+    long i = 0;
+    switch (op) {
+        case VEC_ADD: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, _mm256_add_epi64(a, b)) break;
+        case VEC_SUB: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, _mm256_sub_epi64(a, b)) break;
+        case VEC_MUL: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, vec_mul_avx2(a, b)) break;
+        case VEC_GT: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, _mm256_and_si256(_mm256_cmpgt_epi64(a, b), one)) break;
+        case VEC_LT: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, _mm256_and_si256(_mm256_cmpgt_epi64(b, a), one)) break;
+        case VEC_LE: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, _mm256_andnot_si256(_mm256_cmpgt_epi64(a, b), one)) break;
+        case VEC_GE: VEC_LOOP(4, __m256i, _mm256_loadu_si256, _mm256_set1_epi64x,
+            _mm256_storeu_si256, _mm256_andnot_si256(_mm256_cmpgt_epi64(b, a), one)) break;
+    }
+    return i;
+}
+
+static long vec_kernel_sse2(int op, int64_t* out, int64_t* x, int64_t xs,
+                            int64_t* y, int64_t ys, long n) {
+    /* SSE2 has no 64 bit compare, those are left to the plain loop */
+    long i = 0;
+    switch (op) {
+        case VEC_ADD: VEC_LOOP(2, __m128i, _mm_loadu_si128, _mm_set1_epi64x,
+            _mm_storeu_si128, _mm_add_epi64(a, b)) break;
+        case VEC_SUB: VEC_LOOP(2, __m128i, _mm_loadu_si128, _mm_set1_epi64x,
+            _mm_storeu_si128, _mm_sub_epi64(a, b)) break;
+        case VEC_MUL: VEC_LOOP(2, __m128i, _mm_loadu_si128, _mm_set1_epi64x,
+            _mm_storeu_si128, vec_mul_sse2(a, b)) break;
+    }
+    return i;
+}
+
+/* a with its bits flipped where it's negative, ORed into w. Finds how
+wide the numbers going through a reduction are in the same pass */
+#define VEC_WIDE_AVX2(w, a) \
+    w = _mm256_or_si256(w, _mm256_xor_si256(a, _mm256_cmpgt_epi64(_mm256_setzero_si256(), a)))
+
+__attribute__((target("avx2")))
+static uint64_t vec_lanes_or(__m256i w) {
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, w);
+    return lanes[0] | lanes[1] | lanes[2] | lanes[3];
+}
+
+__attribute__((target("avx2")))
+static int64_t vec_sum_avx2(int64_t* x, long n, long* done, uint64_t* wide) {
+    __m256i acc = _mm256_setzero_si256(), w = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(x + i));
+        acc = _mm256_add_epi64(acc, a);
+        VEC_WIDE_AVX2(w, a);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    *done = i;
+    *wide = vec_lanes_or(w);
+    return (int64_t)((uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2")))
+static int64_t vec_dot_avx2(int64_t* x, int64_t* y, long n, long* done, uint64_t* wide) {
+    __m256i acc = _mm256_setzero_si256();
+    __m256i wx = _mm256_setzero_si256(), wy = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(y + i));
+        acc = _mm256_add_epi64(acc, vec_mul_avx2(a, b));
+        VEC_WIDE_AVX2(wx, a);
+        VEC_WIDE_AVX2(wy, b);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    *done = i;
+    wide[0] = vec_lanes_or(wx);
+    wide[1] = vec_lanes_or(wy);
+    return (int64_t)((uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2")))
+static int64_t vec_extreme_avx2(int64_t* x, long n, int max, long* done) {
+    /* Needs n >= 4 */
+    __m256i acc = _mm256_loadu_si256((const __m256i*)x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i take = max ? _mm256_cmpgt_epi64(b, acc) : _mm256_cmpgt_epi64(acc, b);
+        acc = _mm256_blendv_epi8(acc, b, take);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    int64_t r = lanes[0];
+    for (int k = 1; k < 4; k++) {
+        if (max ? lanes[k] > r : lanes[k] < r) { r = lanes[k]; }
+    }
+    *done = i;
+    return r;
+}
+
+#endif
+
+void vec_kernel(int op, int64_t* out, int64_t* x, int64_t xs, int64_t* y, int64_t ys, long n) {
+    long i = 0;
+#ifdef TYSON_SIMD
+    i = vec_avx2() ? vec_kernel_avx2(op, out, x, xs, y, ys, n)
+        : vec_kernel_sse2(op, out, x, xs, y, ys, n);
+#endif
+    for (; i < n; i++) { out[i] = vec_op1(op, x ? x[i] : xs, y ? y[i] : ys); }
+}
+
+/* The reductions wrap around, and also give how wide the numbers were:
+the smallest b with -2^b <= x[i] < 2^b for all of them */
+#define VEC_WIDE(w, a) (w |= (a) < 0 ? ~(uint64_t)(a) : (uint64_t)(a))
+
+int vec_width(uint64_t w) { return w ? 64 - __builtin_clzll(w) : 0; }
+
+int64_t vec_sum(int64_t* x, long n, int* bits) {
+    long i = 0;
+    uint64_t r = 0, w = 0;
+#ifdef TYSON_SIMD
+    if (vec_avx2()) { r = vec_sum_avx2(x, n, &i, &w); }
+#endif
+    for (; i < n; i++) { r += x[i]; VEC_WIDE(w, x[i]); }
+    *bits = vec_width(w);
+    return (int64_t)r;
+}
+
+int64_t vec_dot(int64_t* x, int64_t* y, long n, int* bits) {
+    /* bits is the widths of x and y added up */
+    long i = 0;
+    uint64_t r = 0, w[2] = {0, 0};
+#ifdef TYSON_SIMD
+    if (vec_avx2()) { r = vec_dot_avx2(x, y, n, &i, w); }
+#endif
+    for (; i < n; i++) { r += (uint64_t)x[i] * y[i]; VEC_WIDE(w[0], x[i]); VEC_WIDE(w[1], y[i]); }
+    *bits = vec_width(w[0]) + vec_width(w[1]);
+    return (int64_t)r;
+}
+
+int64_t vec_extreme(int64_t* x, long n, int max) {
+    /* Needs n >= 1 */
+    long i = 1;
+    int64_t r = x[0];
+#ifdef TYSON_SIMD
+    if (vec_avx2() && n >= 4) { r = vec_extreme_avx2(x, n, max, &i); }
+#endif
+    for (; i < n; i++) {
+        if (max ? x[i] > r : x[i] < r) { r = x[i]; }
+    }
+    return r;
+}
+
+int lval_vec_args(lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        if (ltype(a->cell[i]) == LVAL_VEC) { return 1; }
+    }
+    return 0;
+}
+
+lval* lval_vec_binop(int op, lval* x, lval* y) {
+    /* x op y elementwise, where one of them may be a number */
+    long n = ltype(x) == LVAL_VEC ? x->length : y->length;
+    if (ltype(x) == LVAL_VEC && ltype(y) == LVAL_VEC && x->length != y->length) {
+        return lval_err("Vectors of different lengths. Got %li and %li.",
+            x->length, y->length);
+    }
+    lval* r = lval_vec(n);
+    if (ltype(r) == LVAL_ERR) { return r; }
+    vec_kernel(op, r->ints,
+        ltype(x) == LVAL_VEC ? x->ints : NULL, ltype(x) == LVAL_NUM ? lnum(x) : 0,
+        ltype(y) == LVAL_VEC ? y->ints : NULL, ltype(y) == LVAL_NUM ? lnum(y) : 0, n);
+    return r;
+}
+
+lval* lval_vec_op(lval* a, char* op) {
+    /* builtin_op and the orderings, given at least one vector */
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, ltype(a->cell[i]) == LVAL_NUM || ltype(a->cell[i]) == LVAL_VEC,
+            "Function '%s' passed incorrect type for argument %i. Got %s, Expected Vector or Number.",
+            op, i, ltype_name(ltype(a->cell[i])));
+    }
+
+    int code = -1;
+    char* ops[] = { "+", "-", "*", "<", ">", "<=", ">=" };
+    for (int i = 0; i < 7; i++) {
+        if (strcmp(op, ops[i]) == 0) { code = i; }
+    }
+    LASSERT(a, code != -1, "Function '%s' can't be used on vectors.", op);
+    if (code >= VEC_LT) { LASSERT_ARG_NUM(op, a, 2); }
+
+    /* (- v) negates */
+    lval* x = a->count == 1 && code == VEC_SUB ?
+        lval_vec_binop(VEC_SUB, lval_num(0), a->cell[0]) : lval_ref(a->cell[0]);
+
+    for (int i = 1; i < a->count && ltype(x) != LVAL_ERR; i++) {
+        lval* y = lval_vec_binop(code, x, a->cell[i]);
+        lval_del(x);
+        x = y;
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_vec(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("vec", a, 1);
+    if (ltype(a->cell[0]) == LVAL_VEC) { return lval_take(a, 0); }
+    LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+    lval* q = lval_cells(a->cell[0]);
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, ltype(q->cell[i]) == LVAL_NUM,
+            "Function 'vec' passed a %s, Expected only Numbers.",
+            ltype_name(ltype(q->cell[i])));
+    }
+    lval* v = lval_vec(q->count);
+    if (ltype(v) == LVAL_ERR) { lval_del(a); return v; }
+    for (int i = 0; i < q->count; i++) { v->ints[i] = lnum(q->cell[i]); }
+    lval_del(a);
+    return v;
+}
+
+lval* builtin_range(lenv* e, lval* a) {
+    /* (range n) is 0 to n-1, (range a b) a to b-1 */
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Function 'range' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+        a->count);
+    for (int i = 0; i < a->count; i++) { LASSERT_TYPE("range", a, i, LVAL_NUM); }
+
+    long from = a->count == 2 ? lnum(a->cell[0]) : 0;
+    long to = lnum(a->cell[a->count - 1]);
+    /* Unsigned, as to - from can be past LONG_MAX */
+    uint64_t n = to > from ? (uint64_t)to - (uint64_t)from : 0;
+    LASSERT(a, n <= VEC_MAX,
+        "Function 'range' length too large. Got %llu, Expected at most %li.",
+        (unsigned long long)n, VEC_MAX);
+    lval_del(a);
+
+    lval* v = lval_vec(n);
+    if (ltype(v) == LVAL_ERR) { return v; }
+    for (long i = 0; i < v->length; i++) { v->ints[i] = from + i; }
+    return v;
+}
+
+lval* builtin_vec_list(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("vec->list", a, 1);
+    LASSERT_TYPE("vec->list", a, 0, LVAL_VEC);
+    lval* v = a->cell[0];
+    lval* q = lval_qexpr();
+    q->cell = pool_alloc(sizeof(lval*) * v->length);
+    q->count = v->length;
+    for (long i = 0; i < v->length; i++) { q->cell[i] = lval_num(v->ints[i]); }
+    lval_del(a);
+    return q;
+}
+
+lval* vec_exact(int op, int64_t* x, int64_t* y, long n) {
+    /* Sum (VEC_ADD) or product (VEC_MUL) of x, or with y the sum of
+    x[i] * y[i], going on in big numbers from where it stops fitting */
+    int64_t r = op == VEC_MUL ? 1 : 0, t;
+    long i = 0;
+    for (; i < n; i++) {
+        t = x[i];
+        if (y && __builtin_mul_overflow(x[i], y[i], &t)) { break; }
+        if (op == VEC_MUL ? __builtin_mul_overflow(r, t, &t) : __builtin_add_overflow(r, t, &t)) { break; }
+        r = t;
+        if (op == VEC_MUL && r == 0) { return lval_num(0); }
+    }
+    lval* acc = lval_num(r);
+    for (; i < n; i++) {
+        lval* z = lval_num(x[i]);
+        if (y) { z = lval_big_op(lval_add(lval_add(lval_sexpr(), z), lval_num(y[i])), "*"); }
+        acc = lval_big_op(lval_add(lval_add(lval_sexpr(), acc), z), op == VEC_MUL ? "*" : "+");
+    }
+    return acc;
+}
+
+#define VEC_BLOCK 1024
+
+lval* vec_fold(int64_t* x, int64_t* y, long n) {
+    /* vec_exact's sums with the SIMD kernels a block at a time, as long
+    as how wide a block's numbers were shows it didn't overflow: each
+    is within 2^bits, so m of them add up to within 2^(bits + width of m).
+    Products don't get this, over 62 numbers only fit if they're all
+    0 or 1 or -1 */
+    int64_t r = 0, t;
+    for (long i = 0; i < n; i += VEC_BLOCK) {
+        long m = n - i < VEC_BLOCK ? n - i : VEC_BLOCK;
+        int bits;
+        t = y ? vec_dot(x + i, y + i, m, &bits) : vec_sum(x + i, m, &bits);
+        if (bits + vec_width(m) > 63 || __builtin_add_overflow(r, t, &r)) {
+            return vec_exact(VEC_ADD, x, y, n);
+        }
+    }
+    return lval_num(r);
+}
+
+lval* lval_vec_reduce(lval* a, char* func) {
+    /* Sums and products don't wrap like elementwise ops do */
+    LASSERT_ARG_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_VEC);
+    lval* v = a->cell[0];
+    lval* r;
+    if (strcmp(func, "vec-sum") == 0) { r = vec_fold(v->ints, NULL, v->length); }
+    else if (strcmp(func, "vec-prod") == 0) { r = vec_exact(VEC_MUL, v->ints, NULL, v->length); }
+    else {
+        LASSERT(a, v->length > 0, "Function '%s' passed an empty vector.", func);
+        r = lval_num(vec_extreme(v->ints, v->length, strcmp(func, "vec-max") == 0));
+    }
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_vec_sum(lenv* e, lval* a) { return lval_vec_reduce(a, "vec-sum"); }
+lval* builtin_vec_prod(lenv* e, lval* a) { return lval_vec_reduce(a, "vec-prod"); }
+lval* builtin_vec_min(lenv* e, lval* a) { return lval_vec_reduce(a, "vec-min"); }
+lval* builtin_vec_max(lenv* e, lval* a) { return lval_vec_reduce(a, "vec-max"); }
+
+lval* builtin_dot(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("dot", a, 2);
+    LASSERT_TYPE("dot", a, 0, LVAL_VEC);
+    LASSERT_TYPE("dot", a, 1, LVAL_VEC);
+    LASSERT(a, a->cell[0]->length == a->cell[1]->length,
+        "Vectors of different lengths. Got %li and %li.",
+        a->cell[0]->length, a->cell[1]->length);
+    lval* r = vec_fold(a->cell[0]->ints, a->cell[1]->ints, a->cell[0]->length);
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_prefix_sum(lenv* e, lval* a) {
+    /* Running totals. Each one needs the last, so this one is a plain loop */
+    LASSERT_ARG_NUM("prefix-sum", a, 1);
+    LASSERT_TYPE("prefix-sum", a, 0, LVAL_VEC);
+    lval* v = a->cell[0];
+    lval* r = lval_vec(v->length);
+    if (ltype(r) == LVAL_ERR) { lval_del(a); return r; }
+    uint64_t total = 0;
+    for (long i = 0; i < v->length; i++) {
+        total += v->ints[i];
+        r->ints[i] = (int64_t)total;
+    }
+    lval_del(a);
+    return r;
+}
+
+/* Sorted maps
+
+   A B+ tree ordered like < and >: numbers before strings, strings by
+   their bytes. Keys and values are in the leaves, and the nodes above
+   hold copies of keys to find them by. Nodes are shared between copies
+   of a map just like trie nodes, and copied on the way to a change */
+
+int lval_cmp(lval* x, lval* y) {
+    /* -1, 0 or 1 as x is before, the same as or after y. 2 for NaN */
+    int tx = ltype(x), ty = ltype(y);
+    if (tx == LVAL_NUM && ty == LVAL_NUM) {
+        long a = lnum(x), b = lnum(y);
+        return (a > b) - (a < b);
+    }
+    if (tx == LVAL_STR || ty == LVAL_STR) {
+        if (tx != ty) { return tx == LVAL_STR ? 1 : -1; }
+        long n = x->len < y->len ? x->len : y->len;
+        int c = n ? memcmp(lval_chars(x), lval_chars(y), n) : 0;
+        if (c) { return c < 0 ? -1 : 1; }
+        return (x->len > y->len) - (x->len < y->len);
+    }
+    if (tx == LVAL_FLOAT || ty == LVAL_FLOAT) {
+        double a = lval_to_double(x), b = lval_to_double(y);
+        return a < b ? -1 : a > b ? 1 : a == b ? 0 : 2;
+    }
+    return lval_big_cmp(x, y);
+}
+
+int lval_is_ordered(lval* k) {
+    /* Anything lval_cmp puts in order, so everything < takes but NaN */
+    int t = ltype(k);
+    return t == LVAL_NUM || t == LVAL_BIG || t == LVAL_STR
+        || (t == LVAL_FLOAT && k->fnum == k->fnum);
+}
+
+int lval_tree_lower(lval* n, lval* k) {
+    /* Index of the first key in node n that isn't before k */
+    int lo = 0, hi = n->tcount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (lval_cmp(n->tkeys[mid], k) < 0) { lo = mid + 1; } else { hi = mid; }
+    }
+    return lo;
+}
+
+int lval_tree_upper(lval* n, lval* k) {
+    /* Index of the first key in node n after k. Below a node, child i
+    has the keys from key i-1 up to but not including key i */
+    int lo = 0, hi = n->tcount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (lval_cmp(n->tkeys[mid], k) <= 0) { lo = mid + 1; } else { hi = mid; }
+    }
+    return lo;
+}
+
+lval** lval_tree_find(lval* m, lval* k) {
+    /* The cell holding k's value in sorted map m. NULL if it's not there */
+    lval* n = m->root;
+    while (n && !n->tleaf) { n = n->titems[lval_tree_upper(n, k)]; }
+    if (!n) { return NULL; }
+    int i = lval_tree_lower(n, k);
+    return i < n->tcount && lval_cmp(n->tkeys[i], k) == 0 ? &n->titems[i] : NULL;
+}
+
+lval* lval_tnode_own(lval* n) {
+    /* Copy on write, as lval_own */
+    if (n->refs == 1) { return n; }
+    lval* x = lval_tnode(n->tleaf);
+    for (int i = 0; i < n->tcount; i++) { x->tkeys[i] = lval_ref(n->tkeys[i]); }
+    for (int i = 0; i < n->tcount + !n->tleaf; i++) { x->titems[i] = lval_ref(n->titems[i]); }
+    x->tcount = n->tcount;
+    n->refs--;
+    return x;
+}
+
+lval* lval_tnode_split(lval* n, lval** up_key, lval** up_node) {
+    /* Moves the top half of n, which has a key too many, to a new node.
+    In a leaf the first key there is copied up, otherwise the middle
+    key moves up */
+    int half = n->tcount / 2;
+    lval* r = lval_tnode(n->tleaf);
+    if (n->tleaf) {
+        r->tcount = n->tcount - half;
+        memcpy(r->tkeys, &n->tkeys[half], sizeof(lval*) * r->tcount);
+        memcpy(r->titems, &n->titems[half], sizeof(lval*) * r->tcount);
+        *up_key = lval_ref(r->tkeys[0]);
+    } else {
+        r->tcount = n->tcount - half - 1;
+        memcpy(r->tkeys, &n->tkeys[half + 1], sizeof(lval*) * r->tcount);
+        memcpy(r->titems, &n->titems[half + 1], sizeof(lval*) * (r->tcount + 1));
+        *up_key = n->tkeys[half];
+    }
+    n->tcount = half;
+    *up_node = r;
+    return n;
+}
+
+lval* lval_tnode_put(lval* n, lval* k, lval* v, int* added, lval** up_key, lval** up_node) {
+    /* n with k set to v. Takes n, k and v, and sets added if k is new.
+    If n splits, its right half comes back in up_node, and the key to
+    go between the halves in up_key */
+    n = lval_tnode_own(n);
+    *up_node = NULL;
+    if (n->tleaf) {
+        int i = lval_tree_lower(n, k);
+        if (i < n->tcount && lval_cmp(n->tkeys[i], k) == 0) {
+            lval_del(k);
+            lval_del(n->titems[i]);
+            n->titems[i] = v;
+            return n;
+        }
+        memmove(&n->tkeys[i + 1], &n->tkeys[i], sizeof(lval*) * (n->tcount - i));
+        memmove(&n->titems[i + 1], &n->titems[i], sizeof(lval*) * (n->tcount - i));
+        n->tkeys[i] = k;
+        n->titems[i] = v;
+        n->tcount++;
+        *added = 1;
+    } else {
+        int i = lval_tree_upper(n, k);
+        lval* down = n->titems[i];
+        lval* key;
+        lval* right;
+        n->titems[i] = NULL;
+        n->titems[i] = lval_tnode_put(down, k, v, added, &key, &right);
+        if (!right) { return n; }
+        memmove(&n->tkeys[i + 1], &n->tkeys[i], sizeof(lval*) * (n->tcount - i));
+        memmove(&n->titems[i + 2], &n->titems[i + 1], sizeof(lval*) * (n->tcount - i));
+        n->tkeys[i] = key;
+        n->titems[i + 1] = right;
+        n->tcount++;
+    }
+    return n->tcount > TREE_MAX ? lval_tnode_split(n, up_key, up_node) : n;
+}
+
+lval* lval_tree_put(lval* root, lval* k, lval* v, int* added) {
+    /* Tree root, or an empty one if NULL, with k set to v. Takes root, k
+    and v, and sets added if k is new */
+    lval* key;
+    lval* right;
+    root = lval_tnode_put(root ? root : lval_tnode(1), k, v, added, &key, &right);
+    if (!right) { return root; }
+    lval* top = lval_tnode(0);
+    top->tkeys[0] = key;
+    top->titems[0] = root;
+    top->titems[1] = right;
+    top->tcount = 1;
+    return top;
+}
+
+void lval_tnode_fix(lval* n, int i) {
+    /* Child i of n, which must be ours, is down to too few keys. Moves
+    one over from a neighbour that can spare it, or else merges it
+    with one */
+    lval* c = n->titems[i];
+    if (i > 0 && n->titems[i - 1]->tcount > TREE_MIN) {
+        lval* l = n->titems[i - 1];
+        n->titems[i - 1] = NULL;
+        l = n->titems[i - 1] = lval_tnode_own(l);
+        memmove(&c->tkeys[1], &c->tkeys[0], sizeof(lval*) * c->tcount);
+        memmove(&c->titems[1], &c->titems[0], sizeof(lval*) * (c->tcount + !c->tleaf));
+        if (c->tleaf) {
+            c->tkeys[0] = l->tkeys[l->tcount - 1];
+            c->titems[0] = l->titems[l->tcount - 1];
+            lval_del(n->tkeys[i - 1]);
+            n->tkeys[i - 1] = lval_ref(c->tkeys[0]);
+        } else {
+            c->tkeys[0] = n->tkeys[i - 1];
+            c->titems[0] = l->titems[l->tcount];
+            n->tkeys[i - 1] = l->tkeys[l->tcount - 1];
+        }
+        l->tcount--;
+        c->tcount++;
+        return;
+    }
+    if (i < n->tcount && n->titems[i + 1]->tcount > TREE_MIN) {
+        lval* r = n->titems[i + 1];
+        n->titems[i + 1] = NULL;
+        r = n->titems[i + 1] = lval_tnode_own(r);
+        if (c->tleaf) {
+            c->tkeys[c->tcount] = r->tkeys[0];
+            c->titems[c->tcount] = r->titems[0];
+            memmove(&r->titems[0], &r->titems[1], sizeof(lval*) * (r->tcount - 1));
+        } else {
+            c->tkeys[c->tcount] = n->tkeys[i];
+            c->titems[c->tcount + 1] = r->titems[0];
+            n->tkeys[i] = r->tkeys[0];
+            memmove(&r->titems[0], &r->titems[1], sizeof(lval*) * r->tcount);
+        }
+        memmove(&r->tkeys[0], &r->tkeys[1], sizeof(lval*) * (r->tcount - 1));
+        r->tcount--;
+        c->tcount++;
+        if (c->tleaf) {
+            lval_del(n->tkeys[i]);
+            n->tkeys[i] = lval_ref(r->tkeys[0]);
+        }
+        return;
+    }
+
+    /* Neither can, so they fit in one node together */
+    int j = i > 0 ? i - 1 : i;
+    lval* l = n->titems[j];
+    lval* r = n->titems[j + 1];
+    n->titems[j] = NULL;
+    l = lval_tnode_own(l);
+    if (l->tleaf) { lval_del(n->tkeys[j]); }
+    else { l->tkeys[l->tcount++] = n->tkeys[j]; }
+    for (int x = 0; x < r->tcount; x++) { l->tkeys[l->tcount + x] = lval_ref(r->tkeys[x]); }
+    for (int x = 0; x < r->tcount + !r->tleaf; x++) { l->titems[l->tcount + x] = lval_ref(r->titems[x]); }
+    l->tcount += r->tcount;
+    memmove(&n->tkeys[j], &n->tkeys[j + 1], sizeof(lval*) * (n->tcount - j - 1));
+    memmove(&n->titems[j + 1], &n->titems[j + 2], sizeof(lval*) * (n->tcount - j - 1));
+    n->tcount--;
+    n->titems[j] = l;
+    lval_del(r);
+}
+
+lval* lval_tnode_remove(lval* n, lval* k) {
+    /* n without k, which must be in it. Takes n. It can be left with too
+    few keys, for its parent to see to */
+    n = lval_tnode_own(n);
+    if (n->tleaf) {
+        int i = lval_tree_lower(n, k);
+        lval_del(n->tkeys[i]);
+        lval_del(n->titems[i]);
+        memmove(&n->tkeys[i], &n->tkeys[i + 1], sizeof(lval*) * (n->tcount - i - 1));
+        memmove(&n->titems[i], &n->titems[i + 1], sizeof(lval*) * (n->tcount - i - 1));
+        n->tcount--;
+        return n;
+    }
+    int i = lval_tree_upper(n, k);
+    lval* down = n->titems[i];
+    n->titems[i] = NULL;
+    n->titems[i] = lval_tnode_remove(down, k);
+    if (n->titems[i]->tcount < TREE_MIN) { lval_tnode_fix(n, i); }
+    return n;
+}
+
+lval* lval_tree_remove(lval* root, lval* k) {
+    /* Tree root without k, which must be in it. Takes root. NULL if
+    that leaves it empty */
+    root = lval_tnode_remove(root, k);
+    if (root->tcount) { return root; }
+    lval* x = root->tleaf ? NULL : lval_ref(root->titems[0]);
+    lval_del(root);
+    return x;
+}
+
+int lval_tnode_fill(lval* n, lval** keys, lval** vals, int count) {
+    /* Puts n's keys and values in order in keys and vals from index
+    count on, as lval_node_fill. Gives back where they got up to */
+    if (!n->tleaf) {
+        for (int i = 0; i <= n->tcount; i++) {
+            count = lval_tnode_fill(n->titems[i], keys, vals, count);
+        }
+        return count;
+    }
+    for (int i = 0; i < n->tcount; i++, count++) {
+        if (keys) { keys[count] = n->tkeys[i]; }
+        if (vals) { vals[count] = n->titems[i]; }
+    }
+    return count;
+}
+
+lval* lval_tree_build(lval** keys, lval** vals, int n) {
+    /* Tree of n keys in order, no two the same, and their values. Takes
+    them all. Goes a level at a time from the leaves up, spreading the
+    keys evenly, so it's O(n) */
+    if (!n) { return NULL; }
+    int count = (n + TREE_MAX - 1) / TREE_MAX;
+    lval** level = malloc(sizeof(lval*) * count);
+    lval** lows = malloc(sizeof(lval*) * count);
+    for (int i = 0, at = 0; i < count; i++) {
+        int size = n / count + (i < n % count);
+        lval* x = lval_tnode(1);
+        memcpy(x->tkeys, &keys[at], sizeof(lval*) * size);
+        memcpy(x->titems, &vals[at], sizeof(lval*) * size);
+        x->tcount = size;
+        level[i] = x;
+        lows[i] = keys[at];
+        at += size;
+    }
+    /* Then as few nodes as hold those as children, over and over */
+    while (count > 1) {
+        int up = (count + TREE_MAX) / (TREE_MAX + 1);
+        for (int i = 0, at = 0; i < up; i++) {
+            int size = count / up + (i < count % up);
+            lval* x = lval_tnode(0);
+            for (int j = 0; j < size; j++) {
+                x->titems[j] = level[at + j];
+                if (j) { x->tkeys[j - 1] = lval_ref(lows[at + j]); }
+            }
+            x->tcount = size - 1;
+            level[i] = x;
+            lows[i] = lows[at];
+            at += size;
+        }
+        count = up;
+    }
+    lval* root = level[0];
+    free(level);
+    free(lows);
+    return root;
+}
+
+int lval_tnode_span(lval* n, lval* lo, lval* hi, lval** cell, int count) {
+    /* Counts the entries of n with keys from lo to hi, or if cell isn't
+    NULL, also puts them there as {k v} from index count on. Only goes
+    down to the leaves that have some */
+    if (!n->tleaf) {
+        for (int i = lval_tree_upper(n, lo), last = lval_tree_upper(n, hi); i <= last; i++) {
+            count = lval_tnode_span(n->titems[i], lo, hi, cell, count);
+        }
+        return count;
+    }
+    for (int i = lval_tree_lower(n, lo), last = lval_tree_upper(n, hi); i < last; i++, count++) {
+        if (cell) {
+            cell[count] = lval_add(lval_add(lval_qexpr(), lval_ref(n->tkeys[i])),
+                lval_ref(n->titems[i]));
+        }
+    }
+    return count;
+}
+
+lval* lval_tnode_floor(lval* n, lval* k, int* at) {
+    /* Leaf with the last key of n not after k, which is at index at.
+    NULL if there's none. A key that has since gone can still be
+    sitting between two children, so the one to the left may have it */
+    if (n->tleaf) {
+        *at = lval_tree_upper(n, k) - 1;
+        return *at >= 0 ? n : NULL;
+    }
+    for (int i = lval_tree_upper(n, k); i >= 0; i--) {
+        lval* x = lval_tnode_floor(n->titems[i], k, at);
+        if (x) { return x; }
+    }
+    return NULL;
+}
+
+lval* lval_tnode_ceiling(lval* n, lval* k, int* at) {
+    /* Leaf with the first key of n not before k, as lval_tnode_floor */
+    if (n->tleaf) {
+        *at = lval_tree_lower(n, k);
+        return *at < n->tcount ? n : NULL;
+    }
+    for (int i = lval_tree_upper(n, k); i <= n->tcount; i++) {
+        lval* x = lval_tnode_ceiling(n->titems[i], k, at);
+        if (x) { return x; }
+    }
+    return NULL;
+}
+
+lval* lval_order(lval* a, char* op) {
+    /* < > <= >= on anything but two plain numbers. Two strings go by
+    their bytes */
+    if (lval_vec_args(a)) { return lval_vec_op(a, op); }
+    LASSERT_ARG_NUM(op, a, 2);
+    int strs = 0;
+    for (int i = 0; i < 2; i++) {
+        int t = ltype(a->cell[i]);
+        LASSERT(a, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLOAT || t == LVAL_STR,
+            "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+            op, i, ltype_name(t), ltype_name(LVAL_NUM));
+        strs += t == LVAL_STR;
+    }
+    LASSERT(a, strs != 1,
+        "Function '%s' passed a String and a Number, which can't be compared.", op);
+
+    int c = lval_cmp(a->cell[0], a->cell[1]);
+    int r = c == 2 ? 0 : strcmp(op, "<") == 0 ? c < 0 : strcmp(op, ">") == 0 ? c > 0
+        : strcmp(op, "<=") == 0 ? c <= 0 : c >= 0;
+    lval_del(a);
+    return lval_num(r);
+}
+
+/* Two plain numbers are compared right here, the rest by lval_order */
+#define ORDERING(op, a, comp) \
+    if (a->count != 2 || ltype(a->cell[0]) != LVAL_NUM || ltype(a->cell[1]) != LVAL_NUM) { \
+        return lval_order(a, op); \
+    } \
+    int r = comp; \
+    lval_del(a); \
+    return lval_num(r)
+
+lval* builtin_leq(lenv* e, lval* a) {
+    ORDERING("<=", a, (lnum(a->cell[0]) <= lnum(a->cell[1])));
+}
+
+lval* builtin_geq(lenv* e, lval* a) {
+    ORDERING(">=", a, (lnum(a->cell[0]) >= lnum(a->cell[1])));
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+    ORDERING("<", a, (lnum(a->cell[0]) < lnum(a->cell[1])));
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+    ORDERING(">", a, (lnum(a->cell[0]) > lnum(a->cell[1])));
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("==", a, 2);
+    int r = lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_neq(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("!=", a, 2);
+    int r = !lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* lval_if_branch(lval* a) {
+    /* Acts like a ternary operator */
+    LASSERT_ARG_NUM("if", a, 3);
+    LASSERT_TYPE("if", a, 0, LVAL_NUM);
+    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+    /* Take the chosen branch and mark it as evaluatable */
+    lval* x = lval_own(lval_pop(a, lnum(a->cell[0]) ? 1 : 2));
+    x->type = LVAL_SEXPR;
+
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+    lval* x = lval_if_branch(a);
+    return ltype(x) == LVAL_ERR ? x : lval_eval(e, x);
+}
+
+lval* lval_clause_branch(lenv* e, lval* a, char* func, int first, char* none) {
+    /* Goes through the {condition expression} clauses in a from first on,
+    evaluating conditions in e until one holds. With first 1 a holding
+    means being equal to a->cell[0], otherwise being true. Returns the
+    expression of that clause, still to be evaluated */
+    for (int i = first; i < a->count; i++) {
+        LASSERT_TYPE(func, a, i, LVAL_QEXPR);
+        lval* clause = lval_cells(a->cell[i]);
+        LASSERT(a, clause->count == 2,
+            "Function '%s' passed a clause of %i items for argument %i, Expected 2.",
+            func, clause->count, i);
+
+        lval* cond = lval_eval(e, lval_ref(clause->cell[0]));
+        if (ltype(cond) == LVAL_ERR) { lval_del(a); return cond; }
+        int holds;
+        if (first) {
+            holds = lval_eq(a->cell[0], cond);
+        } else {
+            if (ltype(cond) != LVAL_NUM) {
+                lval* err = lval_err("Function '%s' passed incorrect type for the "
+                    "condition of argument %i. Got %s, Expected Number.",
+                    func, i, ltype_name(ltype(cond)));
+                lval_del(cond);
+                lval_del(a);
+                return err;
+            }
+            holds = lnum(cond) != 0;
+        }
+        lval_del(cond);
+
+        if (holds) {
+            lval* x = lval_ref(clause->cell[1]);
+            lval_del(a);
+            return x;
+        }
+    }
+    lval_del(a);
+    return lval_err(none);
+}
+
+lval* lval_select_branch(lenv* e, lval* a) {
+    return lval_clause_branch(e, a, "select", 0, "No selection found");
+}
+
+lval* lval_case_branch(lenv* e, lval* a) {
+    LASSERT(a, a->count > 0,
+        "Function 'case' passed incorrect number of arguments. Got 0, Expected at least 1.");
+    return lval_clause_branch(e, a, "case", 1, "No case found");
+}
+
+lval* builtin_select(lenv* e, lval* a) {
+    return lval_eval(e, lval_select_branch(e, a));
+}
+
+lval* builtin_case(lenv* e, lval* a) {
+    return lval_eval(e, lval_case_branch(e, a));
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op) {
+    /* One bit for each type among the arguments. Only plain numbers or
+    only floats go straight to a loop that doesn't check them again */
+    int types = 0;
+    for (int i = 0; i < a->count; i++) { types |= 1 << ltype(a->cell[i]); }
+
+    if (types != 1 << LVAL_NUM) {
+        int numbers = 1 << LVAL_NUM | 1 << LVAL_BIG | 1 << LVAL_FLOAT;
+        if (types == 1 << LVAL_FLOAT) { return lval_float_op(a, op, 0); }
+        if (types & 1 << LVAL_VEC) { return lval_vec_op(a, op); }
+        if (!types || types & ~numbers) {
+            lval_del(a);
+            return lval_err("Cannot operate on non-number!");
+        }
+        if (types & 1 << LVAL_FLOAT) { return lval_float_op(a, op, 1); }
+        return lval_big_op(a, op);
+    }
+
+    /* Accumulate unboxed, only the result becomes a value again.
+    Overflowing starts over with big numbers */
+    char o = op[0];
+    long x = lnum(a->cell[0]);
+
+    /* if no arguments and subtraction then perform unary negation */
+    if (o == '-' && a->count == 1) {
+        if (x == LONG_MIN) { return lval_big_op(a, op); }
+        x = -x;
+    }
+
+    for (int i = 1; i < a->count; i++) {
+        long y = lnum(a->cell[i]);
+
+        if (o == '+' && __builtin_add_overflow(x, y, &x)) { return lval_big_op(a, op); }
+        if (o == '-' && __builtin_sub_overflow(x, y, &x)) { return lval_big_op(a, op); }
+        if (o == '*' && __builtin_mul_overflow(x, y, &x)) { return lval_big_op(a, op); }
+        if (o == '/') {
+            if (y == 0) {
+                lval_del(a);
+                return lval_err("Division By Zero!");
+            }
+            if (x == LONG_MIN && y == -1) { return lval_big_op(a, op); }
+            x /= y;
+        }
+    }
+    lval_del(a);
+
+    return lval_num(x);
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+    /* Check error conditions */
+    LASSERT(a, a->count == 1,
+        TOO_MANY_ARGUMENTS_EXCEPTION("head", a->count, 1));
+    LASSERT(a, ltype(a->cell[0]) == LVAL_QEXPR,
+        WRONG_TYPE_EXCEPTION("head", ltype_name(ltype(a->cell[0])), 0,
+            ltype_name(LVAL_QEXPR)));
+    LASSERT(a, a->cell[0]->count != 0,
+        EMPTY_LIST_EXCEPTION("head"));
+
+    /* Otherwise take first argument, leaving the rest untouched */
+    lval* v = lval_take(a, 0);
+    return lval_slice(v, 0, 1);
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    /* Check Error Conditions */
+    LASSERT(a, a->count == 1,
+        TOO_MANY_ARGUMENTS_EXCEPTION("tail", a->count, 1));
+    LASSERT(a, ltype(a->cell[0]) == LVAL_QEXPR,
+        WRONG_TYPE_EXCEPTION("tail", ltype_name(ltype(a->cell[0])), 0,
+            ltype_name(LVAL_QEXPR)));
+    LASSERT(a, a->cell[0]->count != 0,
+        EMPTY_LIST_EXCEPTION("tail"));
+
+    /* Everything but the first element, sharing the cells */
+    lval* v = lval_take(a, 0);
+    return lval_slice(v, 1, v->count - 1);
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+lval* lval_eval_expr(lval* a) {
+    LASSERT(a, a->count == 1,
+        TOO_MANY_ARGUMENTS_EXCEPTION("eval", a->count, 1));
+    LASSERT(a, ltype(a->cell[0]) == LVAL_QEXPR,
+        WRONG_TYPE_EXCEPTION("eval", ltype_name(ltype(a->cell[0])), 0,
+            ltype_name(LVAL_QEXPR)));
+
+    lval* x = lval_own(lval_take(a, 0));
+    x->type = LVAL_SEXPR;
+    return x;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+    lval* x = lval_eval_expr(a);
+    return ltype(x) == LVAL_ERR ? x : lval_eval(e, x);
+}
+
+void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_set(lenv* e, lsym* s, lval* v);
+
+/* Call frames
+
+   Functions are never changed by calling them. A full call binds its
+   arguments in a fresh frame env instead, and frames are handed back
+   here on return, so a call normally allocates nothing. A frame that
+   something still refers to afterwards, like a closure created in it,
+   is simply left to the heap */
+
+#define FRAME_CACHE 256
+
+struct {
+    lenv* free[FRAME_CACHE];
+    int count;
+} frames;
+
+lenv* lenv_frame(lval* f, lenv* caller) {
+    /* Frame for a call of f from caller, holding what f has bound so far */
+    lenv* e = frames.count ? frames.free[--frames.count] : lenv_new();
+    e->scope = f->env->scope;
+    if (lexical_scope) {
+        e->parent = f->env->parent ? lenv_ref(f->env->parent) : NULL;
+    } else {
+        e->parent = caller;
+    }
+    for (int i = 0; i < f->env->count; i++) {
+        lenv_set(e, f->env->syms[i], f->env->vals[i]);
+    }
+    return e;
+}
+
+void lenv_frame_release(lenv* e) {
+    if (e->refs > 1 || frames.count == FRAME_CACHE) {
+        lenv_del(e);
+        return;
+    }
+    /* Keep the arrays, they fit the next call just as well */
+    for (int i = 0; i < e->count; i++) {
+        lsym_bound(e->syms[i], -1);
+        lval_del(e->vals[i]);
+    }
+    e->count = 0;
+    if (e->index) {
+        pool_free(e->index, sizeof(int) * e->index_capacity);
+        e->index = NULL;
+        e->index_capacity = 0;
+    }
+    if (lexical_scope && e->parent) { lenv_del(e->parent); }
+    e->parent = NULL;
+    frames.free[frames.count++] = e;
+}
+
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame) {
+    /* Binds the arguments a of lambda f, taking ownership of a. For a
+    full call it sets *frame, for f's body to be evaluated there, and
+    returns NULL. Otherwise f is used up too, *frame is NULL and the
+    result is returned */
+    *frame = NULL;
+
+    lval* formals = lval_cells(f->formals);
+    int given = a->count;
+    int total = formals->count;
+
+    /* Special case: list after & symbol. Same as ... in c kinda */
+    int fixed = total;
+    for (int i = 0; i < total; i++) {
+        if (formals->cell[i]->sym == sym_amp) { fixed = i; break; }
+    }
+    if (fixed < total && fixed != total - 2) {
+        lval_del(a); lval_del(f);
+        return lval_err("Function format invalid. "
+            "Symbol '&' not followed by single symbol.");
+    }
+    if (fixed == total && given > total) {
+        lval_del(a); lval_del(f);
+        return lval_err(TOO_MANY_ARGUMENTS_EXCEPTION("<lambda>", given, total));
+    }
+
+    /* Too few arguments: return a copy with some of them filled in */
+    if (given < fixed) {
+        lval* g = lval_copy(f);
+        lval_del(f);
+        for (int i = 0; i < given; i++) {
+            lenv_set(g->env, formals->cell[i]->sym, a->cell[i]);
+        }
+        g->formals = lval_slice(g->formals, given, total - given);
+        lval_del(a);
+        return g;
+    }
+
+    lenv* call = lenv_frame(f, e);
+    for (int i = 0; i < fixed; i++) {
+        lenv_set(call, formals->cell[i]->sym, a->cell[i]);
+    }
+    /* Symbol after & gets a list of all extra arguments, maybe empty */
+    if (fixed < total) {
+        lval* rest = lval_qexpr();
+        for (int i = fixed; i < given; i++) {
+            rest = lval_add(rest, lval_ref(a->cell[i]));
+        }
+        lenv_set(call, formals->cell[total-1]->sym, rest);
+        lval_del(rest);
+    }
+    lval_del(a);
+
+    *frame = call;
+    return NULL;
+}
+
+lval* lval_eval_apply(lenv* e, lval* f, lval* v);
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    /* Takes ownership of both f and a */
+
+    /* If it's builtin, simply call it */
+    if (f->builtin) {
+        lbuiltin builtin = f->builtin;
+        lval_del(f);
+        return builtin(e, a);
+    }
+
+    return lval_eval_apply(e, f, a);
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, ltype(a->cell[i]) == LVAL_QEXPR,
+            WRONG_TYPE_EXCEPTION("join", ltype_name(ltype(a->cell[i])), i,
+                ltype_name(LVAL_QEXPR)));
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    while (a->count) {
+        x = lval_concat(x, lval_pop(a, 0));
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1,
+        TOO_MANY_ARGUMENTS_EXCEPTION("len", a->count, 1));
+    int t = ltype(a->cell[0]);
+    LASSERT(a, t == LVAL_QEXPR || t == LVAL_VEC || t == LVAL_MAP || t == LVAL_SET
+        || t == LVAL_SORTED || t == LVAL_PQ,
+        WRONG_TYPE_EXCEPTION("len", ltype_name(t), 0,
+            ltype_name(LVAL_QEXPR)));
+
+    lval* x = lval_take(a, 0);
+    long count = t == LVAL_VEC ? x->length
+        : t == LVAL_QEXPR ? x->count : t == LVAL_PQ ? x->hsize : x->mcount;
+    lval_del(x);
+
+    return lval_num(count);
+}
+
+/* String functions
+
+   substr, split and str->list give views, sharing the bytes of the
+   string they came from. concat makes ropes out of long strings */
+
+lval* builtin_str_len(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("str-len", a, 1);
+    LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+    long n = a->cell[0]->len;
+    lval_del(a);
+    return lval_num(n);
+}
+
+lval* builtin_substr(lenv* e, lval* a) {
+    /* (substr s start count), or to the end without count */
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'substr' passed incorrect number of arguments. Got %i, Expected 2 or 3.",
+        a->count);
+    LASSERT_TYPE("substr", a, 0, LVAL_STR);
+    for (int i = 1; i < a->count; i++) { LASSERT_TYPE("substr", a, i, LVAL_NUM); }
+
+    long len = a->cell[0]->len;
+    long start = lnum(a->cell[1]);
+    LASSERT(a, start >= 0 && start <= len,
+        "Function 'substr' passed index %li for a string of %li bytes.", start, len);
+    long count = a->count == 3 ? lnum(a->cell[2]) : len - start;
+    LASSERT(a, count >= 0 && count <= len - start,
+        "Function 'substr' passed count %li from index %li for a string of %li bytes.",
+        count, start, len);
+
+    lval* v = lval_take(a, 0);
+    return lval_str_view(v, start, count);
+}
+
+lval* builtin_concat(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) { LASSERT_TYPE("concat", a, i, LVAL_STR); }
+    lval* x = lval_str("");
+    while (a->count) { x = lval_str_concat(x, lval_pop(a, 0)); }
+    lval_del(a);
+    return x;
+}
+
+long lval_str_find(lval* s, lval* sub, long from) {
+    /* Index of the first sub in s from from on, -1 if there is none */
+    char* hay = lval_chars(s);
+    char* needle = lval_chars(sub);
+    long n = sub->len;
+    if (n == 0) { return from <= s->len ? from : -1; }
+    for (long i = from; i + n <= s->len; i++) {
+        char* p = memchr(hay + i, needle[0], s->len - n + 1 - i);
+        if (!p) { return -1; }
+        i = p - hay;
+        if (memcmp(p, needle, n) == 0) { return i; }
+    }
+    return -1;
+}
+
+lval* builtin_index_of(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("index-of", a, 2);
+    LASSERT_TYPE("index-of", a, 0, LVAL_STR);
+    LASSERT_TYPE("index-of", a, 1, LVAL_STR);
+    long i = lval_str_find(a->cell[0], a->cell[1], 0);
+    lval_del(a);
+    return lval_num(i);
+}
+
+lval* lval_str_split(lval* a) {
+    /* (split s sep): the pieces of s between the seps */
+    LASSERT_TYPE("split", a, 1, LVAL_STR);
+    LASSERT(a, a->cell[1]->len > 0, "Function 'split' passed an empty separator.");
+
+    lval* s = a->cell[0];
+    long sep = a->cell[1]->len;
+    lval* q = lval_qexpr();
+    long from = 0;
+    while (1) {
+        long at = lval_str_find(s, a->cell[1], from);
+        long end = at == -1 ? s->len : at;
+        q = lval_add(q, lval_str_view(lval_ref(s), from, end - from));
+        if (at == -1) { break; }
+        from = at + sep;
+    }
+    lval_del(a);
+    return q;
+}
+
+lval* builtin_str_list(lenv* e, lval* a) {
+    /* Q-expression of the one byte strings in a string */
+    LASSERT_ARG_NUM("str->list", a, 1);
+    LASSERT_TYPE("str->list", a, 0, LVAL_STR);
+    lval* s = a->cell[0];
+    lval_chars(s);
+    lval* q = lval_qexpr();
+    q->cell = pool_alloc(sizeof(lval*) * (s->len ? s->len : 1));
+    for (long i = 0; i < s->len; i++) {
+        q->cell[i] = lval_str_view(lval_ref(s), i, 1);
+        q->count++;
+    }
+    if (!s->len) {
+        pool_free(q->cell, sizeof(lval*));
+        q->cell = NULL;
+    }
+    lval_del(a);
+    return q;
+}
+
+lval* builtin_list_str(lenv* e, lval* a) {
+    /* The strings in a Q-expression, joined in one go */
+    LASSERT_ARG_NUM("list->str", a, 1);
+    LASSERT_TYPE("list->str", a, 0, LVAL_QEXPR);
+    lval* q = lval_cells(a->cell[0]);
+    long len = 0;
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, ltype(q->cell[i]) == LVAL_STR,
+            "Function 'list->str' passed a %s, Expected only Strings.",
+            ltype_name(ltype(q->cell[i])));
+        len += q->cell[i]->len;
+    }
+    char* s = malloc(len + 1);
+    char* p = s;
+    for (int i = 0; i < q->count; i++) {
+        memcpy(p, lval_chars(q->cell[i]), q->cell[i]->len);
+        p += q->cell[i]->len;
+    }
+    *p = '\0';
+    lval_del(a);
+    return lval_str_own(s, len);
+}
+
+lval* builtin_num_str(lenv* e, lval* a) {
+    /* A number written out, the same way print does */
+    LASSERT_ARG_NUM("num->str", a, 1);
+    lval* x = a->cell[0];
+    int t = ltype(x);
+    LASSERT(a, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLOAT,
+        "Function 'num->str' passed incorrect type for argument 0. Got %s, Expected Number.",
+        ltype_name(t));
+
+    lval* r;
+    if (t == LVAL_BIG) {
+        char* digits = lval_big_str(x);
+        r = lval_str_own(digits, strlen(digits));
+    } else {
+        char buf[32];
+        if (t == LVAL_NUM) { snprintf(buf, sizeof(buf), "%li", lnum(x)); }
+        else { lval_float_str(buf, sizeof(buf), x->fnum); }
+        r = lval_str(buf);
+    }
+    lval_del(a);
+    return r;
+}
+
+int lval_is_number_text(char* s) {
+    /* Whether s is written like a number literal */
+    if (*s == '-') { s++; }
+    if (!isdigit((unsigned char)*s)) { return 0; }
+    while (isdigit((unsigned char)*s)) { s++; }
+    if (*s == '.') {
+        s++;
+        if (!isdigit((unsigned char)*s)) { return 0; }
+        while (isdigit((unsigned char)*s)) { s++; }
+    }
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '-' || *s == '+') { s++; }
+        if (!isdigit((unsigned char)*s)) { return 0; }
+        while (isdigit((unsigned char)*s)) { s++; }
+    }
+    return *s == '\0';
+}
+
+lval* builtin_str_num(lenv* e, lval* a) {
+    /* Reads a number, written like one in code */
+    LASSERT_ARG_NUM("str->num", a, 1);
+    LASSERT_TYPE("str->num", a, 0, LVAL_STR);
+    char* s = lval_str_dup(a->cell[0]);
+    lval* r = lval_is_number_text(s) ? lval_read_number(s)
+        : lval_err("Function 'str->num' passed \"%s\", which isn't a number.", s);
+    free(s);
+    lval_del(a);
+    return r;
+}
+
+/* List functions
+
+   Natives for what std.tyson used to define with head, tail and join,
+   which made most of them quadratic. They do the same in one pass.
+   Like std's fst, the ones that look at elements (nth, last, in, map,
+   filter, foldLeft, sum) evaluate them first, so symbols in the list
+   stand for their values. take, drop, split and filter keep them as
+   they are */
+
+lval* lval_elem(lenv* e, lval* x) {
+    /* What fst gives for an element x */
+    int t = ltype(x);
+    return t == LVAL_SYM || t == LVAL_SEXPR ? lval_eval(e, lval_ref(x)) : lval_ref(x);
+}
+
+lval* lval_apply(lenv* e, lval* f, lval* args) {
+    /* Calls f, which stays ours, with args, which doesn't */
+    if (ltype(f) != LVAL_FUN) {
+        lval_del(args);
+        return lval_err("first element is not a function!");
+    }
+    return lval_call(e, lval_ref(f), args);
+}
+
+lval* lval_apply1(lenv* e, lval* f, lval* x) {
+    return lval_apply(e, f, lval_add(lval_sexpr(), x));
+}
+
+lval* lval_apply2(lenv* e, lval* f, lval* x, lval* y) {
+    return lval_apply(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+}
+
+lval* lval_list_of(lval** cell, int count, int capacity) {
+    /* Q-expression taking over the first count items of cell, an array
+    with room for capacity */
+    lval* q = lval_qexpr();
+    if (count == 0) {
+        pool_free(cell, sizeof(lval*) * capacity);
+        return q;
+    }
+    if (count < capacity) {
+        cell = pool_realloc(cell, sizeof(lval*) * capacity, sizeof(lval*) * count);
+    }
+    q->cell = cell;
+    q->count = count;
+    return q;
+}
+
+lval* lval_list_abort(lval** cell, int count, int capacity, lval* a, lval* err) {
+    /* Gives up on a list being built, returning err */
+    for (int i = 0; i < count; i++) { lval_del(cell[i]); }
+    pool_free(cell, sizeof(lval*) * capacity);
+    lval_del(a);
+    return err;
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[1]);
+    int n = l->count;
+    lval** cell = pool_alloc(sizeof(lval*) * (n ? n : 1));
+    for (int i = 0; i < n; i++) {
+        lval* x = lval_elem(e, l->cell[i]);
+        if (ltype(x) != LVAL_ERR) { x = lval_apply1(e, a->cell[0], x); }
+        if (ltype(x) == LVAL_ERR) { return lval_list_abort(cell, i, n ? n : 1, a, x); }
+        cell[i] = x;
+    }
+    lval_del(a);
+    return lval_list_of(cell, n, n ? n : 1);
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[1]);
+    int n = l->count, kept = 0;
+    lval** cell = pool_alloc(sizeof(lval*) * (n ? n : 1));
+    for (int i = 0; i < n; i++) {
+        lval* x = lval_elem(e, l->cell[i]);
+        if (ltype(x) != LVAL_ERR) { x = lval_apply1(e, a->cell[0], x); }
+        if (ltype(x) != LVAL_ERR && ltype(x) != LVAL_NUM) {
+            lval* err = lval_err("Function 'filter' got %s from its function, Expected Number.",
+                ltype_name(ltype(x)));
+            lval_del(x);
+            x = err;
+        }
+        if (ltype(x) == LVAL_ERR) { return lval_list_abort(cell, kept, n ? n : 1, a, x); }
+        if (lnum(x)) { cell[kept++] = lval_ref(l->cell[i]); }
+        lval_del(x);
+    }
+    lval_del(a);
+    return lval_list_of(cell, kept, n ? n : 1);
+}
+
+lval* builtin_foldLeft(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("foldLeft", a, 3);
+    LASSERT_TYPE("foldLeft", a, 2, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[2]);
+    lval* acc = lval_ref(a->cell[1]);
+    for (int i = 0; i < l->count && ltype(acc) != LVAL_ERR; i++) {
+        lval* x = lval_elem(e, l->cell[i]);
+        if (ltype(x) == LVAL_ERR) { lval_del(acc); acc = x; break; }
+        acc = lval_apply2(e, a->cell[0], acc, x);
+    }
+    lval_del(a);
+    return acc;
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+    /* foldLeft + 0, except that a vector is summed too */
+    LASSERT_ARG_NUM("sum", a, 1);
+    if (ltype(a->cell[0]) == LVAL_VEC) { return lval_vec_reduce(a, "vec-sum"); }
+    LASSERT_TYPE("sum", a, 0, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[0]);
+    lval* acc = lval_num(0);
+    for (int i = 0; i < l->count && ltype(acc) != LVAL_ERR; i++) {
+        lval* x = lval_elem(e, l->cell[i]);
+        if (ltype(x) == LVAL_ERR) { lval_del(acc); acc = x; break; }
+        long y;
+        if (ltype(acc) == LVAL_NUM && ltype(x) == LVAL_NUM
+            && !__builtin_add_overflow(lnum(acc), lnum(x), &y)) {
+            lval_del(acc);
+            lval_del(x);
+            acc = lval_num(y);
+        } else {
+            acc = builtin_op(e, lval_add(lval_add(lval_sexpr(), acc), x), "+");
+        }
+    }
+    lval_del(a);
+    return acc;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+    long n = lnum(a->cell[0]);
+    lval* l = lval_cells(a->cell[1]);
+    LASSERT(a, n >= 0 && n < l->count,
+        "Function 'nth' passed index %li for a list of %i items.", n, l->count);
+
+    lval* x = lval_elem(e, l->cell[n]);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("last", a, 1);
+    LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count != 0, EMPTY_LIST_EXCEPTION("last"));
+
+    lval* l = lval_cells(a->cell[0]);
+    lval* x = lval_elem(e, l->cell[l->count - 1]);
+    lval_del(a);
+    return x;
+}
+
+lval* lval_split_at(lval* a, char* func) {
+    /* Checks (func n l), leaving n valid for l */
+    LASSERT_ARG_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_NUM);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    long n = lnum(a->cell[0]);
+    LASSERT(a, n >= 0 && n <= a->cell[1]->count,
+        "Function '%s' passed %li for a list of %i items.", func, n, a->cell[1]->count);
+    return a;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+    a = lval_split_at(a, "take");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    long n = lnum(a->cell[0]);
+    lval* l = lval_take(a, 1);
+    return lval_slice(l, 0, n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+    a = lval_split_at(a, "drop");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    long n = lnum(a->cell[0]);
+    lval* l = lval_take(a, 1);
+    return lval_slice(l, n, l->count - n);
+}
+
+lval* builtin_split(lenv* e, lval* a) {
+    if (a->count == 2 && ltype(a->cell[0]) == LVAL_STR) { return lval_str_split(a); }
+    a = lval_split_at(a, "split");
+    if (ltype(a) == LVAL_ERR) { return a; }
+    long n = lnum(a->cell[0]);
+    lval* l = lval_take(a, 1);
+    lval* q = lval_qexpr();
+    q = lval_add(q, lval_slice(lval_ref(l), 0, n));
+    return lval_add(q, lval_slice(l, n, l->count - n));
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("reverse", a, 1);
+    LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[0]);
+    int n = l->count;
+    lval** cell = pool_alloc(sizeof(lval*) * (n ? n : 1));
+    for (int i = 0; i < n; i++) { cell[i] = lval_ref(l->cell[n - 1 - i]); }
+    lval_del(a);
+    return lval_list_of(cell, n, n ? n : 1);
+}
+
+lval* builtin_in(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("in", a, 2);
+    /* A key of a map or set. Nothing that can't be a key is ever in one */
+    int t = ltype(a->cell[1]);
+    if (t == LVAL_MAP || t == LVAL_SET || t == LVAL_SORTED) {
+        unsigned h;
+        int found = lval_key_ok(a->cell[1], a->cell[0], &h)
+            && lval_map_find(a->cell[1], a->cell[0], h);
+        lval_del(a);
+        return lval_num(found);
+    }
+    LASSERT_TYPE("in", a, 1, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[1]);
+    int found = 0;
+    for (int i = 0; i < l->count && !found; i++) {
+        lval* x = lval_elem(e, l->cell[i]);
+        if (ltype(x) == LVAL_ERR) { lval_del(a); return x; }
+        found = lval_eq(a->cell[0], x);
+        lval_del(x);
+    }
+    lval_del(a);
+    return lval_num(found);
+}
+
+lval* lval_unpack_expr(lval* a) {
+    /* (unpack f {x y}) is (f x y), still to be evaluated */
+    LASSERT_ARG_NUM("unpack", a, 2);
+    LASSERT_TYPE("unpack", a, 1, LVAL_QEXPR);
+
+    lval* xs = lval_cells(a->cell[1]);
+    lval** cell = pool_alloc(sizeof(lval*) * (xs->count + 1));
+    cell[0] = lval_ref(a->cell[0]);
+    for (int i = 0; i < xs->count; i++) { cell[i + 1] = lval_ref(xs->cell[i]); }
+    lval* x = lval_list_of(cell, xs->count + 1, xs->count + 1);
+    x->type = LVAL_SEXPR;
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_unpack(lenv* e, lval* a) {
+    return lval_eval(e, lval_unpack_expr(a));
+}
+
+lval* builtin_do(lenv* e, lval* a) {
+    /* Arguments are evaluated in order already, the last one is the result */
+    if (a->count == 0) { lval_del(a); return lval_qexpr(); }
+    return lval_take(a, a->count - 1);
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+  return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+  return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  return builtin_op(e, a, "/");
+}
+
+int lenv_find(lenv* e, lsym* s);
+
+lval* lval_resolve(lval* v, lval* formals, lenv* e, int scope) {
+    /* Copy of v with its symbols annotated for lookup from a frame of
+    scope. Formals are bound into the frame in order, '&' takes no slot */
+    switch (ltype(v)) {
+        case LVAL_SYM: {
+            lval* x = lval_copy(v);
+            x->scope = scope;
+            x->depth = -1;
+            int slot = 0;
+            for (int i = 0; i < formals->count; i++) {
+                if (formals->cell[i]->sym == sym_amp) { continue; }
+                if (formals->cell[i]->sym == v->sym) {
+                    x->depth = 0;
+                    x->slot = slot;
+                    return x;
+                }
+                slot++;
+            }
+            int depth = 1;
+            for (; e; e = e->parent, depth++) {
+                int i = lenv_find(e, v->sym);
+                if (i != -1) {
+                    x->depth = depth;
+                    x->slot = i;
+                    break;
+                }
+            }
+            return x;
+        }
+        case LVAL_QEXPR:
+        case LVAL_SEXPR: {
+            lval_cells(v);
+            lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            for (int i = 0; i < v->count; i++) {
+                x = lval_add(x, lval_resolve(v->cell[i], formals, e, scope));
+            }
+            return x;
+        }
+        default:
+            return lval_ref(v);
+    }
+}
+
+/* Hash map functions
+
+   put and remove give back a changed map and leave the one passed in
+   as it was. Keys can be numbers, strings, symbols, vectors or lists of
+   those, or for a sorted map numbers and strings. keys, values and
+   items come out in the same order, which for a hash map has nothing
+   to do with the order things went in, and for a sorted map is the
+   order of the keys */
+
+lval* lval_map_add(char* func, lval* m, lval* k, lval* v) {
+    /* Puts k and v in m, which must be ours. Takes k and v, and gives
+    back NULL, or the error that kept them out */
+    unsigned h;
+    lval* err = NULL;
+    if (ltype(k) == LVAL_ERR) { err = lval_ref(k); }
+    else if (v && ltype(v) == LVAL_ERR) { err = lval_ref(v); }
+    else if (!lval_key_ok(m, k, &h)) {
+        err = lval_err("Function '%s' passed a %s as a key, which can't be %s.",
+            func, ltype_name(ltype(k)), m->type == LVAL_SORTED ? "ordered" : "hashed");
+    }
+    if (err) {
+        lval_del(k);
+        if (v) { lval_del(v); }
+        return err;
+    }
+    lval_map_put(m, k, h, v);
+    return NULL;
+}
+
+lval* lval_map_from(lenv* e, lval* a, int type) {
+    /* (hashmap {{k v} ...}), (sortedmap {{k v} ...}) or (hashset {x ...}).
+    Like fst, symbols in there stand for their values */
+    char* func = type == LVAL_MAP ? "hashmap" : type == LVAL_SET ? "hashset" : "sortedmap";
+    LASSERT_ARG_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval* l = lval_cells(a->cell[0]);
+    lval* m = lval_map(type);
+    /* Sorted map entries wait here while their keys keep going up, to be
+    built into the tree all at once */
+    int run = type == LVAL_SORTED, n = 0;
+    lval** keys = run ? malloc(sizeof(lval*) * (l->count ? l->count : 1)) : NULL;
+    lval** vals = run ? malloc(sizeof(lval*) * (l->count ? l->count : 1)) : NULL;
+    lval* err = NULL;
+    for (int i = 0; i < l->count && !err; i++) {
+        lval* x = lval_elem(e, l->cell[i]);
+        if (type == LVAL_SET) {
+            err = lval_map_add(func, m, x, NULL);
+        } else if (ltype(x) == LVAL_QEXPR && x->count == 2) {
+            lval_cells(x);
+            lval* k = lval_elem(e, x->cell[0]);
+            lval* v = lval_elem(e, x->cell[1]);
+            lval_del(x);
+            if (run && lval_is_ordered(k) && ltype(v) != LVAL_ERR
+                && (!n || lval_cmp(keys[n - 1], k) < 0)) {
+                keys[n] = lval_map_key(k);
+                vals[n++] = v;
+                continue;
+            }
+            if (run) {
+                m->root = lval_tree_build(keys, vals, n);
+                m->mcount = n;
+                run = 0;
+            }
+            err = lval_map_add(func, m, k, v);
+        } else if (ltype(x) == LVAL_ERR) {
+            err = x;
+        } else {
+            lval_del(x);
+            err = lval_err("Function '%s' passed something other than a {key value} pair for entry %i.", func, i);
+        }
+    }
+    if (run) {
+        m->root = lval_tree_build(keys, vals, n);
+        m->mcount = n;
+    }
+    free(keys);
+    free(vals);
+    lval_del(a);
+    if (err) {
+        lval_del(m);
+        return err;
+    }
+    return m;
+}
+
+lval* builtin_hashmap(lenv* e, lval* a) { return lval_map_from(e, a, LVAL_MAP); }
+lval* builtin_hashset(lenv* e, lval* a) { return lval_map_from(e, a, LVAL_SET); }
+lval* builtin_sortedmap(lenv* e, lval* a) { return lval_map_from(e, a, LVAL_SORTED); }
+
+lval* builtin_map_put(lenv* e, lval* a) {
+    /* (put m k v), or (put s x) for a set */
+    LASSERT_MAP("put", a, 0);
+    LASSERT_ARG_NUM("put", a, (ltype(a->cell[0]) == LVAL_SET ? 2 : 3));
+    unsigned h;
+    LASSERT_KEY("put", a, 1, &h);
+
+    lval* m = lval_own(lval_pop(a, 0));
+    lval* k = lval_pop(a, 0);
+    lval* v = a->count ? lval_pop(a, 0) : NULL;
+    lval_del(a);
+    lval_map_put(m, k, h, v);
+    return m;
+}
+
+lval* builtin_map_get(lenv* e, lval* a) {
+    /* (get m k), or (get m k default) to not mind k being missing */
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'get' passed incorrect number of arguments. Got %i, Expected 2 or 3.",
+        a->count);
+    LASSERT_MAP("get", a, 0);
+    LASSERT(a, ltype(a->cell[0]) != LVAL_SET,
+        "Function 'get' passed a Hash Set, which has no values. Use 'has' instead.");
+    unsigned h;
+    LASSERT_KEY("get", a, 1, &h);
+
+    lval** val = lval_map_find(a->cell[0], a->cell[1], h);
+    LASSERT(a, val || a->count == 3, "Function 'get' passed a key that isn't in the map.");
+    lval* x = lval_ref(val ? *val : a->cell[2]);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_map_has(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("has", a, 2);
+    LASSERT_MAP("has", a, 0);
+    unsigned h;
+    LASSERT_KEY("has", a, 1, &h);
+
+    int found = lval_map_find(a->cell[0], a->cell[1], h) != NULL;
+    lval_del(a);
+    return lval_num(found);
+}
+
+lval* builtin_map_remove(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("remove", a, 2);
+    LASSERT_MAP("remove", a, 0);
+    unsigned h;
+    LASSERT_KEY("remove", a, 1, &h);
+
+    /* Nothing to copy if it isn't there */
+    lval* m = lval_pop(a, 0);
+    if (lval_map_find(m, a->cell[0], h)) {
+        m = lval_own(m);
+        lval_map_remove(m, a->cell[0], h);
+    }
+    lval_del(a);
+    return m;
+}
+
+lval* lval_map_column(lval* a, int values) {
+    /* Q-expression of the keys or values of map a->cell[0] */
+    lval* m = a->cell[0];
+    int n = m->mcount;
+    lval** cell = pool_alloc(sizeof(lval*) * (n ? n : 1));
+    lval_map_fill(m, values ? NULL : cell, values ? cell : NULL);
+    for (int i = 0; i < n; i++) { lval_ref(cell[i]); }
+    lval_del(a);
+    return lval_list_of(cell, n, n ? n : 1);
+}
+
+lval* builtin_keys(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("keys", a, 1);
+    LASSERT_MAP("keys", a, 0);
+    return lval_map_column(a, 0);
+}
+
+lval* builtin_values(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("values", a, 1);
+    LASSERT_MAP("values", a, 0);
+    LASSERT(a, ltype(a->cell[0]) != LVAL_SET,
+        "Function 'values' passed a Hash Set, which has no values.");
+    return lval_map_column(a, 1);
+}
+
+lval* builtin_items(lenv* e, lval* a) {
+    /* {{k v} ...}, which hashmap or sortedmap turns back into the map */
+    LASSERT_ARG_NUM("items", a, 1);
+    LASSERT_MAP("items", a, 0);
+    LASSERT(a, ltype(a->cell[0]) != LVAL_SET,
+        "Function 'items' passed a Hash Set, which has no values.");
+
+    lval* m = a->cell[0];
+    int n = m->mcount;
+    lval** vals;
+    lval** keys = lval_map_entries(m, &vals);
+    lval** cell = pool_alloc(sizeof(lval*) * (n ? n : 1));
+    for (int i = 0; i < n; i++) {
+        cell[i] = lval_add(lval_add(lval_qexpr(), lval_ref(keys[i])), lval_ref(vals[i]));
+    }
+    free(keys);
+    free(vals);
+    lval_del(a);
+    return lval_list_of(cell, n, n ? n : 1);
+}
+
+lval* builtin_merge(lenv* e, lval* a) {
+    /* Everything in either, with the second one's values where both have a key */
+    LASSERT_ARG_NUM("merge", a, 2);
+    LASSERT_MAP("merge", a, 0);
+    LASSERT(a, ltype(a->cell[1]) == ltype(a->cell[0]),
+        "Function 'merge' passed incorrect type for argument 1. Got %s, Expected %s.",
+        ltype_name(ltype(a->cell[1])), ltype_name(ltype(a->cell[0])));
+
+    lval* x = lval_pop(a, 0);
+    lval* y = lval_pop(a, 0);
+    lval_del(a);
+
+    /* Go through the smaller one, putting it into the bigger */
+    int keep = 0;
+    if (x->mcount < y->mcount) {
+        lval* t = x; x = y; y = t;
+        keep = 1;
+    }
+    if (!y->mcount) {
+        lval_del(y);
+        return x;
+    }
+
+    x = lval_own(x);
+    lval** vals;
+    lval** keys = lval_map_entries(y, &vals);
+    for (long i = 0; i < y->mcount; i++) {
+        unsigned h;
+        lval_key_ok(x, keys[i], &h);
+        if (keep && lval_map_find(x, keys[i], h)) { continue; }
+        lval_map_put(x, lval_ref(keys[i]), h, x->type == LVAL_SET ? NULL : lval_ref(vals[i]));
+    }
+    free(keys);
+    free(vals);
+    lval_del(y);
+    return x;
+}
+
+/* Sorted map functions */
+
+lval* builtin_between(lenv* e, lval* a) {
+    /* {{k v} ...} for the keys from lo to hi, both included, in order */
+    LASSERT_ARG_NUM("between", a, 3);
+    LASSERT_TYPE("between", a, 0, LVAL_SORTED);
+    LASSERT_KEY("between", a, 1, NULL);
+    LASSERT_KEY("between", a, 2, NULL);
+
+    lval* m = a->cell[0];
+    lval* lo = a->cell[1];
+    lval* hi = a->cell[2];
+    /* Counted first so only the leaves in range are ever touched */
+    int n = m->root ? lval_tnode_span(m->root, lo, hi, NULL, 0) : 0;
+    lval** cell = pool_alloc(sizeof(lval*) * (n ? n : 1));
+    if (n) { lval_tnode_span(m->root, lo, hi, cell, 0); }
+    lval_del(a);
+    return lval_list_of(cell, n, n ? n : 1);
+}
+
+lval* lval_tree_entry(lval* a, lval* n, int i) {
+    /* {k v} for entry i of leaf n, or {} without one. Takes a, which
+    keeps n alive until then */
+    lval* x = lval_qexpr();
+    if (n) { x = lval_add(lval_add(x, lval_ref(n->tkeys[i])), lval_ref(n->titems[i])); }
+    lval_del(a);
+    return x;
+}
+
+lval* lval_tree_edge(lenv* e, lval* a, char* func, int last) {
+    /* The entry with the first or last key */
+    LASSERT_ARG_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_SORTED);
+
+    lval* n = a->cell[0]->root;
+    while (n && !n->tleaf) { n = n->titems[last ? n->tcount : 0]; }
+    return lval_tree_entry(a, n, n && last ? n->tcount - 1 : 0);
+}
+
+lval* builtin_min_entry(lenv* e, lval* a) { return lval_tree_edge(e, a, "min-entry", 0); }
+lval* builtin_max_entry(lenv* e, lval* a) { return lval_tree_edge(e, a, "max-entry", 1); }
+
+lval* lval_tree_near(lenv* e, lval* a, char* func, int up) {
+    /* The entry with the last key not after k, or the first not before it */
+    LASSERT_ARG_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_SORTED);
+    LASSERT_KEY(func, a, 1, NULL);
+
+    lval* root = a->cell[0]->root;
+    int i = 0;
+    lval* n = !root ? NULL : up ? lval_tnode_ceiling(root, a->cell[1], &i)
+        : lval_tnode_floor(root, a->cell[1], &i);
+    return lval_tree_entry(a, n, i);
+}
+
+lval* builtin_floor_entry(lenv* e, lval* a) { return lval_tree_near(e, a, "floor-entry", 0); }
+lval* builtin_ceiling_entry(lenv* e, lval* a) { return lval_tree_near(e, a, "ceiling-entry", 1); }
+
+/* Priority queue functions
+
+   The heap is a Braun tree: a binary heap where each node's left side
+   has as many items as its right or one more, so it stays balanced
+   without keeping any sizes. Like the maps, changing a queue gives back
+   a new one sharing all but the nodes on one path down */
+
+int lval_pq_before(lenv* e, lval* order, lval* x, lval* y, lval** err) {
+    /* Whether x comes out before y. Once the comparator goes wrong the
+    error stays in err, and the answers stop mattering */
+    if (*err) { return 0; }
+    if (!order) { return lval_cmp(x, y) < 0; }
+    lval* r = lval_apply2(e, order, lval_ref(x), lval_ref(y));
+    if (ltype(r) == LVAL_NUM) {
+        int before = lnum(r) != 0;
+        lval_del(r);
+        return before;
+    }
+    *err = ltype(r) == LVAL_ERR ? lval_ref(r)
+        : lval_err("Priority queue comparator gave back %s, Expected Number.",
+            ltype_name(ltype(r)));
+    lval_del(r);
+    return 0;
+}
+
+lval* lval_heap_push(lenv* e, lval* order, lval* n, lval* x, lval** err) {
+    /* Heap n with x in it. Takes n and x. Whichever of x and the top
+    loses goes into the right side, which then becomes the left */
+    if (!n) { return lval_hnode(x, NULL, NULL); }
+    lval* y = lval_ref(n->hitem);
+    if (lval_pq_before(e, order, y, x, err)) {
+        lval* t = x; x = y; y = t;
+    }
+    lval* left = lval_heap_push(e, order, n->hright ? lval_ref(n->hright) : NULL, y, err);
+    lval* right = n->hleft ? lval_ref(n->hleft) : NULL;
+    lval_del(n);
+    return lval_hnode(x, left, right);
+}
+
+lval* lval_heap_sift(lenv* e, lval* order, lval* x, lval* l, lval* r, lval** err) {
+    /* Heap of x on top of heaps l and r, which must have the sizes of a
+    node's two sides. x goes down past whichever top comes out first
+    until it fits. Takes all three */
+    lval* top = l && lval_pq_before(e, order, l->hitem, x, err) ? l : NULL;
+    if (r && lval_pq_before(e, order, r->hitem, top ? top->hitem : x, err)) { top = r; }
+    if (!top) { return lval_hnode(x, l, r); }
+
+    int left = top == l;
+    lval* y = lval_ref(top->hitem);
+    lval* down = lval_heap_sift(e, order, x, top->hleft ? lval_ref(top->hleft) : NULL,
+        top->hright ? lval_ref(top->hright) : NULL, err);
+    lval_del(top);
+    return left ? lval_hnode(y, down, r) : lval_hnode(y, l, down);
+}
+
+lval* lval_heap_last(lval* n, lval** x) {
+    /* Heap n without an item from its bottom, which goes in x. Takes n.
+    The sides swap on the way back up, as in lval_heap_push */
+    if (!n->hleft) {
+        *x = lval_ref(n->hitem);
+        lval_del(n);
+        return NULL;
+    }
+    lval* left = n->hright ? lval_ref(n->hright) : NULL;
+    lval* right = lval_heap_last(lval_ref(n->hleft), x);
+    lval* y = lval_ref(n->hitem);
+    lval_del(n);
+    return lval_hnode(y, left, right);
+}
+
+lval* lval_heap_pop(lenv* e, lval* order, lval* n, lval** err) {
+    /* Heap n without its top. Takes n. An item from the bottom takes
+    its place and is sifted down */
+    if (!n->hleft) {
+        lval_del(n);
+        return NULL;
+    }
+    lval* x;
+    lval* right = lval_heap_last(lval_ref(n->hleft), &x);
+    lval* left = n->hright ? lval_ref(n->hright) : NULL;
+    lval_del(n);
+    return lval_heap_sift(e, order, x, left, right, err);
+}
+
+lval* lval_heap_build(lenv* e, lval* order, lval** items, int n, lval** err) {
+    /* Heap of the n items, taking them. Both sides are built first and
+    the top sifted down into them, which is O(n) overall */
+    if (!n) { return NULL; }
+    int rn = (n - 1) / 2, ln = n - 1 - rn;
+    lval* l = lval_heap_build(e, order, items + 1, ln, err);
+    lval* r = lval_heap_build(e, order, items + 1 + ln, rn, err);
+    return lval_heap_sift(e, order, items[0], l, r, err);
+}
+
+lval* builtin_pq(lenv* e, lval* a) {
+    /* (pq {x ...}), or (pq f {x ...}) to have (f x y) say whether x comes
+    out before y instead of (< x y). Like fst, symbols in there stand for
+    their values */
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Function 'pq' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+        a->count);
+    if (a->count == 2) { LASSERT_TYPE("pq", a, 0, LVAL_FUN); }
+    LASSERT_TYPE("pq", a, a->count - 1, LVAL_QEXPR);
+
+    lval* order = a->count == 2 ? lval_ref(a->cell[0]) : NULL;
+    lval* l = lval_cells(a->cell[a->count - 1]);
+    int n = l->count;
+    lval** items = malloc(sizeof(lval*) * (n ? n : 1));
+    lval* err = NULL;
+    for (int i = 0; i < n && !err; i++) {
+        items[i] = lval_elem(e, l->cell[i]);
+        if (ltype(items[i]) == LVAL_ERR) {
+            err = items[i];
+        } else if (!order && !lval_is_ordered(items[i])) {
+            err = lval_err("Function 'pq' passed a %s, which can't be ordered without a comparator.",
+                ltype_name(ltype(items[i])));
+            lval_del(items[i]);
+        } else if (!order && i && (ltype(items[i]) == LVAL_STR) != (ltype(items[0]) == LVAL_STR)) {
+            /* Like <, which doesn't compare strings with numbers */
+            err = lval_err("Function 'pq' passed a String and a Number, which can't be compared.");
+            lval_del(items[i]);
+        } else {
+            continue;
+        }
+        for (int j = 0; j < i; j++) { lval_del(items[j]); }
+    }
+    lval* root = err ? NULL : lval_heap_build(e, order, items, n, &err);
+    free(items);
+    lval_del(a);
+    if (err) {
+        if (root) { lval_del(root); }
+        if (order) { lval_del(order); }
+        return err;
+    }
+    return lval_pq(root, order, n);
+}
+
+lval* builtin_pq_push(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("pq-push", a, 2);
+    LASSERT_TYPE("pq-push", a, 0, LVAL_PQ);
+    LASSERT(a, a->cell[0]->horder || lval_is_ordered(a->cell[1]),
+        "Function 'pq-push' passed a %s, which can't be ordered without a comparator.",
+        ltype_name(ltype(a->cell[1])));
+
+    lval* q = a->cell[0];
+    LASSERT(a, q->horder || !q->hroot
+        || (ltype(a->cell[1]) == LVAL_STR) == (ltype(q->hroot->hitem) == LVAL_STR),
+        "Function 'pq-push' passed a String and a Number, which can't be compared.");
+    lval* err = NULL;
+    lval* root = lval_heap_push(e, q->horder, q->hroot ? lval_ref(q->hroot) : NULL,
+        lval_ref(a->cell[1]), &err);
+    if (err) {
+        lval_del(root);
+        lval_del(a);
+        return err;
+    }
+    lval* x = lval_pq(root, q->horder ? lval_ref(q->horder) : NULL, q->hsize + 1);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_pq_pop(lenv* e, lval* a) {
+    /* The queue without what pq-peek gives */
+    LASSERT_ARG_NUM("pq-pop", a, 1);
+    LASSERT_TYPE("pq-pop", a, 0, LVAL_PQ);
+    LASSERT(a, a->cell[0]->hsize, "Function 'pq-pop' passed an empty queue.");
+
+    lval* q = a->cell[0];
+    lval* err = NULL;
+    lval* root = lval_heap_pop(e, q->horder, lval_ref(q->hroot), &err);
+    if (err) {
+        if (root) { lval_del(root); }
+        lval_del(a);
+        return err;
+    }
+    lval* x = lval_pq(root, q->horder ? lval_ref(q->horder) : NULL, q->hsize - 1);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_pq_peek(lenv* e, lval* a) {
+    /* What comes out first */
+    LASSERT_ARG_NUM("pq-peek", a, 1);
+    LASSERT_TYPE("pq-peek", a, 0, LVAL_PQ);
+    LASSERT(a, a->cell[0]->hsize, "Function 'pq-peek' passed an empty queue.");
+
+    lval* x = lval_ref(a->cell[0]->hroot->hitem);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_pq_size(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("pq-size", a, 1);
+    LASSERT_TYPE("pq-size", a, 0, LVAL_PQ);
+
+    long n = a->cell[0]->hsize;
+    lval_del(a);
+    return lval_num(n);
+}
+
+/* Optimizer
+
+   With --optimize the names of builtins are frozen, so a call to one is
+   known at the time a lambda is created. Calls to pure builtins with
+   constant arguments are done then, and ifs with a constant condition
+   are replaced by their branch. Only code is touched: quoted lists are
+   left alone, except the branches of if */
+
+int lval_is_pure(lbuiltin f) {
+    return f == builtin_add || f == builtin_sub || f == builtin_mul
+        || f == builtin_div || f == builtin_eq || f == builtin_neq
+        || f == builtin_gt || f == builtin_lt || f == builtin_geq
+        || f == builtin_leq || f == builtin_list || f == builtin_head
+        || f == builtin_tail || f == builtin_join || f == builtin_len
+        || f == builtin_take || f == builtin_drop || f == builtin_split
+        || f == builtin_reverse || f == builtin_str_len || f == builtin_substr
+        || f == builtin_concat || f == builtin_index_of || f == builtin_num_str;
+}
+
+int lval_is_constant(lval* v) {
+    /* Evaluates to itself */
+    int t = ltype(v);
+    return t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLOAT || t == LVAL_STR
+        || t == LVAL_QEXPR;
+}
+
+lval* lval_fold_body(lenv* e, lval* body);
+lval* lenv_get(lenv* e, lval* k);
+
+lval* lval_unwrap(lval* x) {
+    /* (c) is just c, unless c is a call. Takes ownership of x */
+    if (x->count == 1 && ltype(x->cell[0]) != LVAL_SEXPR && ltype(x->cell[0]) != LVAL_SYM) {
+        return lval_take(x, 0);
+    }
+    return x;
+}
+
+lval* lval_fold(lenv* e, lval* v) {
+    /* Folded copy of the code v */
+    if (ltype(v) != LVAL_SEXPR) { return lval_ref(v); }
+
+    lval_cells(v);
+    lval* x = lval_sexpr();
+    for (int i = 0; i < v->count; i++) {
+        x = lval_add(x, lval_fold(e, v->cell[i]));
+    }
+
+    x = lval_unwrap(x);
+    if (ltype(x) != LVAL_SEXPR || x->count == 0 || ltype(x->cell[0]) != LVAL_SYM || !x->cell[0]->sym->builtin) {
+        return x;
+    }
+
+    lval* f = lenv_get(e, x->cell[0]);
+    lbuiltin builtin = ltype(f) == LVAL_FUN ? f->builtin : NULL;
+    lval_del(f);
+
+    if (builtin == builtin_if && x->count == 4
+        && ltype(x->cell[2]) == LVAL_QEXPR && ltype(x->cell[3]) == LVAL_QEXPR) {
+        if (ltype(x->cell[1]) == LVAL_NUM) {
+                lval* branch = lval_take(x, lnum(x->cell[1]) ? 2 : 3);
+            lval* y = lval_fold_body(e, branch);
+            lval_del(branch);
+            y->type = LVAL_SEXPR;
+            return lval_unwrap(y);
+        }
+        for (int i = 2; i < 4; i++) {
+            lval* branch = lval_fold_body(e, x->cell[i]);
+            lval_del(x->cell[i]);
+            x->cell[i] = branch;
+        }
+        return x;
+    }
+
+    if (!builtin || !lval_is_pure(builtin)) { return x; }
+    for (int i = 1; i < x->count; i++) {
+        if (!lval_is_constant(x->cell[i])) { return x; }
+    }
+
+    /* Errors, like dividing by zero, are left to happen at run time */
+    lval* a = lval_sexpr();
+    for (int i = 1; i < x->count; i++) { a = lval_add(a, lval_ref(x->cell[i])); }
+    lval* r = builtin(e, a);
+    if (ltype(r) == LVAL_ERR) { lval_del(r); return x; }
+    lval_del(x);
+    return r;
+}
+
+lval* lval_fold_body(lenv* e, lval* body) {
+    /* Folded copy of a lambda body or if branch, still a Q-expression */
+    lval* code = lval_copy(body);
+    code->type = LVAL_SEXPR;
+    lval* x = lval_fold(e, code);
+    lval_del(code);
+
+    if (ltype(x) == LVAL_SEXPR) {
+        x = lval_own(x);
+        x->type = LVAL_QEXPR;
+        return x;
+    }
+    return lval_add(lval_qexpr(), x);
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+
+    LASSERT_ARG_NUM("lambda", a, 2);
+    LASSERT_TYPE("lambda", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("lambda", a, 1, LVAL_QEXPR);
+
+    /* Ensure first QEXPR only contains symbols */
+    lval_cells(a->cell[0]);
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (ltype(a->cell[0]->cell[i]) == LVAL_SYM),
+            "Cannot define non-symbol. Got %s, expected %s",
+            ltype_name(ltype(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+        LASSERT(a, !optimize || !a->cell[0]->cell[i]->sym->builtin,
+            "Cannot use builtin '%s' as a formal with --optimize.",
+            a->cell[0]->cell[i]->sym->name);
+    }
+
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    if (optimize) {
+        lval* folded = lval_fold_body(e, body);
+        if (dump_optimized && !lval_eq(body, folded)) {
+            printf("optimized ");
+            lval_print(formals); putchar(' ');
+            lval_print(body); printf(" => ");
+            lval_println(folded);
+        }
+        lval_del(body);
+        body = folded;
+    }
+
+    if (!lexical_scope) { return lval_lambda(formals, body); }
+
+    /* Close over e and work out where every name in the body lives */
+    static int scopes = 0;
+    int scope = ++scopes;
+    lval* resolved = lval_resolve(body, formals, e, scope);
+    lval_del(body);
+
+    lval* f = lval_lambda(formals, resolved);
+    f->env->parent = lenv_ref(e);
+    f->env->scope = scope;
+    return f;
+}
+
+void lenv_index_insert(lenv* e, int i) {
+    unsigned mask = e->index_capacity - 1;
+    unsigned j = e->syms[i]->hash & mask;
+    while (e->index[j]) { j = (j + 1) & mask; }
+    e->index[j] = i + 1;
+}
+
+void lenv_reindex(lenv* e) {
+    /* Rebuild the index, leaving it at most a quarter full */
+    pool_free(e->index, sizeof(int) * e->index_capacity);
+    e->index_capacity = 64;
+    while (e->index_capacity < e->count * 4) { e->index_capacity *= 2; }
+    e->index = pool_alloc(sizeof(int) * e->index_capacity);
+    memset(e->index, 0, sizeof(int) * e->index_capacity);
+    for (int i = 0; i < e->count; i++) { lenv_index_insert(e, i); }
+}
+
+int lenv_find(lenv* e, lsym* s) {
+    /* Position of s in e, -1 if it is not defined here */
+    if (e->index) {
+        unsigned mask = e->index_capacity - 1;
+        for (unsigned j = s->hash & mask; e->index[j]; j = (j + 1) & mask) {
+            if (e->syms[e->index[j]-1] == s) { return e->index[j]-1; }
+        }
+        return -1;
+    }
+    for (int i = 0; i < e->count; i++) {
+        if (e->syms[i] == s) { return i; }
+    }
+    return -1;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+
+    /* Search e and then its parents until a match is found.
+    Return a shared reference to that value */
+    for (; e; e = e->parent) {
+        int i = lenv_find(e, k->sym);
+        if (i != -1) { return lval_ref(e->vals[i]); }
+    }
+    /* If no matching symbol is found, throw error. */
+    return lval_err("Unbound symbol! '%s'", k->sym->name);
+}
 
-    /* Iterate over stuff in environment e */
-    for (int i = 0; i < e->count; i++) {
-        /* Check if the stored string matches the symbol string.
-        If it does, return a copy of that value */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+lval* lenv_get_resolved(lenv* e, lval* k) {
+    /* Lexical lookup. Trust the annotation if it was made for this scope,
+    it is still there and no '=' can have shadowed it since */
+    if (k->scope == e->scope && k->depth >= 0 && !k->sym->assigned) {
+        lenv* f = e;
+        for (int d = k->depth; d && f; d--) { f = f->parent; }
+        if (f && k->slot >= 0 && k->slot < f->count && f->syms[k->slot] == k->sym) {
+            return lval_ref(f->vals[k->slot]);
         }
     }
-    /* Recursively searches parents until a match is found */
-    if (e->parent) {
-        return lenv_get(e->parent, k);
+
+    /* Otherwise search by name, and remember where it was found.
+    Mostly globals defined after the lambda, like recursive calls */
+    int depth = 0;
+    for (lenv* f = e; f; f = f->parent, depth++) {
+        int i = lenv_find(f, k->sym);
+        if (i != -1) {
+            if (k->scope == e->scope) {
+                k->depth = depth;
+                k->slot = i;
+            }
+            return lval_ref(f->vals[i]);
+        }
     }
-    /* If no matching symbol is found, throw error. */
-    return lval_err("Unbound symbol! '%s'", k->sym);
+    return lval_err("Unbound symbol! '%s'", k->sym->name);
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
+void lenv_set(lenv* e, lsym* s, lval* v) {
     /* Defining in local environment */
 
-    /* Iterate over all vals in the envronment.
-    If it already exists, overwrite it. */
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    /* If it already exists, overwrite it. */
+    int i = lenv_find(e, s);
+    if (i != -1) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_ref(v);
+        s->version++;
+        return;
     }
 
-    /* If no existing entry is found. Allocate for a new one */
+    /* If no existing entry is found. Make room for a new one */
+    if (e->count == e->capacity) {
+        int capacity = e->capacity ? e->capacity * 2 : 4;
+        e->vals = pool_realloc(e->vals,
+            sizeof(lval*) * e->capacity, sizeof(lval*) * capacity);
+        e->syms = pool_realloc(e->syms,
+            sizeof(lsym*) * e->capacity, sizeof(lsym*) * capacity);
+        e->capacity = capacity;
+    }
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-    /* Copy args to new location */
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count-1], k->sym);
+    /* Share the value and the interned name */
+    e->vals[e->count-1] = lval_ref(v);
+    e->syms[e->count-1] = s;
+    lsym_bound(s, 1);
+
+    if (e->index && e->count * 2 <= e->index_capacity) {
+        lenv_index_insert(e, e->count-1);
+    } else if (e->count > LENV_HASH_THRESHOLD) {
+        lenv_reindex(e);
+    }
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+    lenv_set(e, k->sym, v);
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -832,7 +5037,7 @@ lval* builtin_get_env(lenv* e, lval* a) {
     lval* env_list = lval_sexpr();
 
     for (int i = 0; i < e->count-1; i++) {
-        lval_add(env_list, lval_sym(e->syms[i]));
+        lval_add(env_list, lval_sym(e->syms[i]->name));
     }
 
     return env_list; /* {head list tail etc} */
@@ -841,19 +5046,25 @@ lval* builtin_get_env(lenv* e, lval* a) {
 lval* builtin_var(lenv* e, lval* a, char* func) {
     LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
-    lval* syms = a->cell[0];
+    lval* syms = lval_cells(a->cell[0]);
 
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (ltype(syms->cell[i]) == LVAL_SYM),
             "Function '%s' cannot define non-symbol. "
             "Got %s, Expected %s.", func,
-            ltype_name(syms->cell[i]->type),
+            ltype_name(ltype(syms->cell[i])),
             ltype_name(LVAL_SYM));
     }
     LASSERT(a, (syms->count == a->count-1),
         "Function '%s' passed too many arguments for symbols. "
         "Got %i, Expected %i.", func, syms->count, a->count-1);
 
+    for (int i = 0; i < syms->count && optimize; i++) {
+        LASSERT(a, !syms->cell[i]->sym->builtin,
+            "Function '%s' cannot redefine builtin '%s' with --optimize.",
+            func, syms->cell[i]->sym->name);
+    }
+
     /* DO THE CHECK ONCE INSTEAD!!! */
     for (int i = 0; i < syms->count; i++) {
     /* If 'def' define in globally. If 'put' define in locally */
@@ -862,6 +5073,7 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
         }
 
         if (strcmp(func, "=") == 0) {
+            syms->cell[i]->sym->assigned = 1;
             lenv_put(e, syms->cell[i], a->cell[i+1]);
         }
     }
@@ -883,6 +5095,7 @@ lval* builtin_put(lenv* e, lval* a) {
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
     lval* k = lval_sym(name);
     lval* v = lval_fun(func);
+    k->sym->builtin = 1;
     lenv_put(e, k, v);
     lval_del(k); lval_del(v);
 }
@@ -904,13 +5117,47 @@ lval* builtin_error(lenv* e, lval* a) {
     LASSERT_ARG_NUM("error", a, 1);
     LASSERT_TYPE("error", a, 0, LVAL_STR);
 
-    lval* err = lval_err(a->cell[0]->str);
+    char* msg = lval_str_dup(a->cell[0]);
+    lval* err = lval_err("%s", msg);
+    free(msg);
 
     lval_del(a);
     return err;
 }
 
+lval* gc_stat(char* name, long value) {
+    return lval_add(lval_add(lval_qexpr(), lval_str(name)), lval_num(value));
+}
+
+lval* builtin_gc_stats(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("gc-stats", a, 1);
+    LASSERT_TYPE("gc-stats", a, 0, LVAL_NUM);
+
+    /* (gc-stats 1) collects first, (gc-stats 0) only reports */
+    if (lnum(a->cell[0])) { gc_collect(); }
+    lval_del(a);
+
+    /* {{"name" value} ...}. header-bytes is the values and envs
+    themselves, not the cells, strings, limbs or slots they point to */
+    lval* x = lval_qexpr();
+    x = lval_add(x, gc_stat("heap-values", gc.values));
+    x = lval_add(x, gc_stat("heap-envs", gc.envs));
+    x = lval_add(x, gc_stat("header-bytes",
+        gc.values * sizeof(lval) + gc.envs * sizeof(lenv)));
+    x = lval_add(x, gc_stat("tracked", gc.count));
+    x = lval_add(x, gc_stat("collections", gc.collections));
+    x = lval_add(x, gc_stat("freed", gc.freed));
+    x = lval_add(x, gc_stat("pause-last-us", gc.pause_last));
+    x = lval_add(x, gc_stat("pause-max-us", gc.pause_max));
+    x = lval_add(x, gc_stat("pause-total-us", gc.pause_total));
+    return x;
+}
+
+lval* builtin_ic_stats(lenv* e, lval* a);
+
 void lenv_add_builtins(lenv* e) {
+    sym_amp = lsym_intern("&");
+
     /* List functions */
     lenv_add_builtin(e, "list", builtin_list);
     lenv_add_builtin(e, "head", builtin_head);
@@ -919,8 +5166,73 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "join", builtin_join);
     lenv_add_builtin(e, "len", builtin_len);
 
+    /* String functions */
+    lenv_add_builtin(e, "str-len", builtin_str_len);
+    lenv_add_builtin(e, "substr", builtin_substr);
+    lenv_add_builtin(e, "concat", builtin_concat);
+    lenv_add_builtin(e, "index-of", builtin_index_of);
+    lenv_add_builtin(e, "str->list", builtin_str_list);
+    lenv_add_builtin(e, "list->str", builtin_list_str);
+    lenv_add_builtin(e, "num->str", builtin_num_str);
+    lenv_add_builtin(e, "str->num", builtin_str_num);
+
+    /* List functions */
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldLeft", builtin_foldLeft);
+    lenv_add_builtin(e, "sum", builtin_sum);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "split", builtin_split);
+    lenv_add_builtin(e, "reverse", builtin_reverse);
+    lenv_add_builtin(e, "in", builtin_in);
+    lenv_add_builtin(e, "unpack", builtin_unpack);
+    lenv_add_builtin(e, "do", builtin_do);
+
+    /* Hash map functions */
+    lenv_add_builtin(e, "hashmap", builtin_hashmap);
+    lenv_add_builtin(e, "hashset", builtin_hashset);
+    lenv_add_builtin(e, "put", builtin_map_put);
+    lenv_add_builtin(e, "get", builtin_map_get);
+    lenv_add_builtin(e, "has", builtin_map_has);
+    lenv_add_builtin(e, "remove", builtin_map_remove);
+    lenv_add_builtin(e, "keys", builtin_keys);
+    lenv_add_builtin(e, "values", builtin_values);
+    lenv_add_builtin(e, "items", builtin_items);
+    lenv_add_builtin(e, "merge", builtin_merge);
+
+    /* Sorted maps */
+    lenv_add_builtin(e, "sortedmap", builtin_sortedmap);
+    lenv_add_builtin(e, "between", builtin_between);
+    lenv_add_builtin(e, "min-entry", builtin_min_entry);
+    lenv_add_builtin(e, "max-entry", builtin_max_entry);
+    lenv_add_builtin(e, "floor-entry", builtin_floor_entry);
+    lenv_add_builtin(e, "ceiling-entry", builtin_ceiling_entry);
+
+    /* Priority queues */
+    lenv_add_builtin(e, "pq", builtin_pq);
+    lenv_add_builtin(e, "pq-push", builtin_pq_push);
+    lenv_add_builtin(e, "pq-pop", builtin_pq_pop);
+    lenv_add_builtin(e, "pq-peek", builtin_pq_peek);
+    lenv_add_builtin(e, "pq-size", builtin_pq_size);
+
+    /* Vectors */
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "range", builtin_range);
+    lenv_add_builtin(e, "vec->list", builtin_vec_list);
+    lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+    lenv_add_builtin(e, "vec-prod", builtin_vec_prod);
+    lenv_add_builtin(e, "vec-min", builtin_vec_min);
+    lenv_add_builtin(e, "vec-max", builtin_vec_max);
+    lenv_add_builtin(e, "dot", builtin_dot);
+    lenv_add_builtin(e, "prefix-sum", builtin_prefix_sum);
+
     /* Conditionals */
     lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "select", builtin_select);
+    lenv_add_builtin(e, "case", builtin_case);
     lenv_add_builtin(e, "==", builtin_eq);
     lenv_add_builtin(e, "!=", builtin_neq);
     lenv_add_builtin(e, ">",  builtin_gt);
@@ -933,6 +5245,10 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "sqrt", builtin_sqrt);
+    lenv_add_builtin(e, "exp", builtin_exp);
+    lenv_add_builtin(e, "log", builtin_log);
+    lenv_add_builtin(e, "floor", builtin_floor);
 
     /* User defined functions */
     lenv_add_builtin(e, "def", builtin_def);
@@ -944,6 +5260,8 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "error", builtin_error);
     lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+    lenv_add_builtin(e, "ic-stats", builtin_ic_stats);
 }
 
 lval* builtin(lenv* e, lval* a, char* func) {
@@ -958,49 +5276,934 @@ lval* builtin(lenv* e, lval* a, char* func) {
     return lval_err("Unknown function!");
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+void lenv_frame_leave(lenv* frame, lenv* next) {
+    /* A tail call from frame went to next, so frame is done with.
+    Dynamically scoped, next could still see the variables in frame,
+    so it takes over the ones it doesn't shadow before frame goes */
+    if (!lexical_scope && next->parent == frame) {
+        for (int i = 0; i < frame->count; i++) {
+            if (lenv_find(next, frame->syms[i]) == -1) {
+                lenv_set(next, frame->syms[i], frame->vals[i]);
+            }
+        }
+        next->parent = frame->parent;
+    }
+    lenv_frame_release(frame);
+}
+
+/* Bytecode
+
+   A lambda body is compiled the first time it is called, into code for
+   a small stack machine. The body owns its code, which holds references
+   to parts of the body as operands. What a name is bound to can change
+   at any time, so the code only assumes where the formals are. Anything
+   else is checked as it runs, falling back to doing just what lval_eval
+   would */
+
+enum { OP_CONST, OP_EMPTY, OP_LOCAL, OP_NAME, OP_CALL, OP_TAILCALL,
+       OP_IF, OP_JUMP, OP_RETURN };
+
+typedef struct {
+    int op;
+    /* Slot, argument count or jump target */
+    int arg;
+    /* OP_IF: where a fallback call goes on, -1 in tail position */
+    int end;
+    /* Constant, symbol or the whole if expression */
+    lval* val;
+    /* OP_NAME: the global value it was last found to be, and the version
+    of the symbol then. Good for as long as nothing else binds it */
+    lval* global;
+    unsigned version;
+} linstr;
+
+typedef struct ljit ljit;
+
+typedef struct {
+    linstr* code;
+    int count;
+    int capacity;
+    /* Deepest the value stack gets */
+    int stack;
+    /* Full calls so far, and whether there is native code for them:
+    0 not tried yet, 1 there is, -1 the body can't be compiled */
+    int calls;
+    int jit;
+    ljit* native;
+} lcode;
+
+struct {
+    lcode** all;
+    int count;
+    int capacity;
+    /* Freed indices, to be reused */
+    int* free;
+    int free_count;
+} codes = { NULL, 1, 0, NULL, 0 };
+
+typedef struct {
+    lcode* c;
+    /* Frame layout: formal i is bound in slot i */
+    lsym** locals;
+    int local_count;
+    int depth;
+} lcompiler;
+
+int lcode_emit(lcompiler* cs, int op, int arg, lval* val, int push) {
+    lcode* c = cs->c;
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->code = realloc(c->code, sizeof(linstr) * c->capacity);
+    }
+    c->code[c->count] = (linstr){ op, arg, -1, val ? lval_ref(val) : NULL, NULL, 0 };
+    cs->depth += push;
+    if (cs->depth > c->stack) { c->stack = cs->depth; }
+    return c->count++;
+}
+
+void lcode_compile(lcompiler* cs, lval* x, int tail);
 
-    /* Evaluate children first */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+void lcode_compile_list(lcompiler* cs, lval* x, int tail) {
+    /* x evaluated as an S-expression, whatever its type */
+    lval_cells(x);
+
+    if (x->count == 0) {
+        lcode_emit(cs, OP_EMPTY, 0, NULL, 1);
+        if (tail) { lcode_emit(cs, OP_RETURN, 0, NULL, -1); }
+        return;
+    }
+    if (x->count == 1) {
+        lcode_compile(cs, x->cell[0], tail);
+        return;
     }
 
-    /* Erorr checking */
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    /* if with literal branches becomes a jump, as long as if is still
+    the builtin when it runs */
+    if (x->count == 4 && ltype(x->cell[0]) == LVAL_SYM
+        && strcmp(x->cell[0]->sym->name, "if") == 0
+        && ltype(x->cell[2]) == LVAL_QEXPR && ltype(x->cell[3]) == LVAL_QEXPR) {
+        lcode_compile(cs, x->cell[0], 0);
+        lcode_compile(cs, x->cell[1], 0);
+        int branch = lcode_emit(cs, OP_IF, 0, x, -2);
+        lcode_compile_list(cs, x->cell[2], tail);
+        int jump = tail ? -1 : lcode_emit(cs, OP_JUMP, 0, NULL, -1);
+        cs->c->code[branch].arg = cs->c->count;
+        lcode_compile_list(cs, x->cell[3], tail);
+        if (!tail) {
+            cs->c->code[jump].arg = cs->c->count;
+            cs->c->code[branch].end = cs->c->count;
+        }
+        return;
+    }
+
+    for (int i = 0; i < x->count; i++) { lcode_compile(cs, x->cell[i], 0); }
+    lcode_emit(cs, tail ? OP_TAILCALL : OP_CALL, x->count, NULL,
+        1 - x->count - tail);
+}
+
+void lcode_compile(lcompiler* cs, lval* x, int tail) {
+    switch (ltype(x)) {
+        case LVAL_SYM: {
+            int slot = -1;
+            for (int i = 0; i < cs->local_count && slot == -1; i++) {
+                if (cs->locals[i] == x->sym) { slot = i; }
+            }
+            if (slot != -1) { lcode_emit(cs, OP_LOCAL, slot, x, 1); }
+            else { lcode_emit(cs, OP_NAME, 0, x, 1); }
+            break;
+        }
+        case LVAL_SEXPR:
+            lcode_compile_list(cs, x, tail);
+            return;
+        default:
+            lcode_emit(cs, OP_CONST, 0, x, 1);
+            break;
+    }
+    if (tail) { lcode_emit(cs, OP_RETURN, 0, NULL, -1); }
+}
+
+lcode* lval_compiled(lval* f) {
+    /* Code for the body of lambda f, compiled now if it wasn't yet */
+    lval* body = lval_cells(f->body);
+    if (body->code) { return codes.all[body->code]; }
+
+    /* Frames hold what f has bound so far, then its formals in order */
+    lval* formals = lval_cells(f->formals);
+    lsym* locals[f->env->count + formals->count + 1];
+    int local_count = 0;
+    for (int i = 0; i < f->env->count; i++) { locals[local_count++] = f->env->syms[i]; }
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym != sym_amp) { locals[local_count++] = formals->cell[i]->sym; }
+    }
+
+    lcode* c = malloc(sizeof(lcode));
+    *c = (lcode){ NULL, 0, 0, 0, 0, 0, NULL };
+    lcompiler cs = { c, locals, local_count, 0 };
+    lcode_compile_list(&cs, body, 1);
+
+    int i;
+    if (codes.free_count) {
+        i = codes.free[--codes.free_count];
+    } else {
+        if (codes.count >= codes.capacity) {
+            codes.capacity = codes.capacity ? codes.capacity * 2 : 64;
+            codes.all = realloc(codes.all, sizeof(lcode*) * codes.capacity);
+            codes.free = realloc(codes.free, sizeof(int) * codes.capacity);
+        }
+        i = codes.count++;
+    }
+    codes.all[i] = c;
+    body->code = i;
+    return c;
+}
+
+void ljit_free(ljit* j);
+
+void lcode_free(int i) {
+    lcode* c = codes.all[i];
+    if (c->native) { ljit_free(c->native); }
+    codes.all[i] = NULL;
+    codes.free[codes.free_count++] = i;
+    for (int j = 0; j < c->count; j++) {
+        if (c->code[j].val) { lval_del(c->code[j].val); }
+        if (c->code[j].global) { lval_del(c->code[j].global); }
     }
+    free(c->code);
+    free(c);
+}
 
-    /* Empty Expression */
-    if (v->count == 0) { return v; }
+void lcode_visit(int i, gc_visitor visit) {
+    lcode* c = codes.all[i];
+    for (int j = 0; j < c->count; j++) {
+        if (c->code[j].val) { gc_visit_val(c->code[j].val, visit); }
+        if (c->code[j].global) { gc_visit_val(c->code[j].global, visit); }
+    }
+}
 
-    /* Single Expression */
-    if (v->count == 1) { return lval_take(v, 0); }
+lval* lcode_args(lval** values, int count) {
+    /* S-expression of count values, taking them over */
+    lval* a = lval_sexpr();
+    if (count) {
+        a->cell = pool_alloc(sizeof(lval*) * count);
+        memcpy(a->cell, values, sizeof(lval*) * count);
+        a->count = count;
+    }
+    return a;
+}
 
-    /* Ensure First Element a function after evaluation */
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval_del(f); lval_del(v);
+lval* lcode_apply(lenv* e, lval** values, int count, lval** tail_f, lval** tail_a) {
+    /* What lval_eval does with an evaluated S-expression, taking over
+    its count values. In tail position, given tail_f, a call is handed
+    back instead of made */
+    for (int i = 0; i < count; i++) {
+        if (ltype(values[i]) == LVAL_ERR) {
+            for (int j = 0; j < count; j++) { if (j != i) { lval_del(values[j]); } }
+            return values[i];
+        }
+    }
+    lval* f = values[0];
+    lval* a = lcode_args(values + 1, count - 1);
+    if (ltype(f) != LVAL_FUN) {
+        lval_del(f); lval_del(a);
         return lval_err("first element is not a function!");
     }
-    /* Call the function that f points to, with the given environment */
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    if (tail_f) {
+        *tail_f = f;
+        *tail_a = a;
+        return NULL;
+    }
+    return lval_call(e, f, a);
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-    /* Get value of symbol from the given environment */
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+/* How often OP_NAME found its global already looked up, see ic-stats */
+struct { long hits; long misses; } ic;
+
+lval* lcode_name(lenv* e, linstr* in) {
+    /* Value of the symbol in->val. A global nothing else binds is looked
+    up once, and then taken from in->global until the symbol's version
+    moves: it is redefined, or bound or unbound anywhere else */
+    lsym* s = in->val->sym;
+    if (in->version == s->version && in->global) {
+        ic.hits++;
+        return lval_ref(in->global);
+    }
+    ic.misses++;
+    if (s->bound == 1) {
+        lenv* root = e;
+        while (root->parent) { root = root->parent; }
+        int i = lenv_find(root, s);
+        if (i != -1) {
+            if (in->global) { lval_del(in->global); }
+            in->global = lval_ref(root->vals[i]);
+            in->version = s->version;
+            return lval_ref(in->global);
+        }
+    }
+    return lexical_scope ? lenv_get_resolved(e, in->val) : lenv_get(e, in->val);
+}
+
+lval* builtin_ic_stats(lenv* e, lval* a) {
+    LASSERT_ARG_NUM("ic-stats", a, 1);
+    LASSERT_TYPE("ic-stats", a, 0, LVAL_NUM);
+
+    /* {{"name" value} ...}, like gc-stats. (ic-stats 1) starts counting
+    over afterwards, (ic-stats 0) only reports */
+    lval* x = lval_qexpr();
+    long lookups = ic.hits + ic.misses;
+    x = lval_add(x, gc_stat("hits", ic.hits));
+    x = lval_add(x, gc_stat("misses", ic.misses));
+    x = lval_add(x, gc_stat("hit-rate-%", lookups ? ic.hits * 100 / lookups : 0));
+    if (lnum(a->cell[0])) { ic.hits = ic.misses = 0; }
+    lval_del(a);
+    return x;
+}
+
+lval* lcode_run(lcode* c, lenv* e, lval** tail_f, lval** tail_a) {
+    /* Runs c in frame e. Either returns the result, or returns NULL with
+    the function and arguments of the tail call to make instead */
+    lval* stack[c->stack + 1];
+    int sp = 0;
+
+    for (int pc = 0;; pc++) {
+        linstr* in = &c->code[pc];
+        switch (in->op) {
+            case OP_CONST:
+                stack[sp++] = lval_ref(in->val);
+                break;
+
+            case OP_EMPTY:
+                stack[sp++] = lval_sexpr();
+                break;
+
+            case OP_LOCAL:
+                if (in->arg < e->count && e->syms[in->arg] == in->val->sym) {
+                    stack[sp++] = lval_ref(e->vals[in->arg]);
+                    break;
+                }
+                /* Not where it was bound. Look it up after all */
+                /* Falls through */
+            case OP_NAME:
+                stack[sp++] = lcode_name(e, in);
+                break;
+
+            case OP_CALL:
+                sp -= in->arg;
+                stack[sp] = lcode_apply(e, stack + sp, in->arg, NULL, NULL);
+                sp++;
+                break;
+
+            case OP_TAILCALL:
+                sp -= in->arg;
+                return lcode_apply(e, stack + sp, in->arg, tail_f, tail_a);
+
+            case OP_IF: {
+                lval* cond = stack[--sp];
+                lval* f = stack[--sp];
+                if (ltype(f) == LVAL_FUN && f->builtin == builtin_if
+                    && ltype(cond) == LVAL_NUM) {
+                    if (!lnum(cond)) { pc = in->arg - 1; }
+                    lval_del(f);
+                    lval_del(cond);
+                    break;
+                }
+                /* if is something else now, or will fail. Call it */
+                lval* call[] = { f, cond,
+                    lval_ref(in->val->cell[2]), lval_ref(in->val->cell[3]) };
+                if (in->end == -1) { return lcode_apply(e, call, 4, tail_f, tail_a); }
+                stack[sp++] = lcode_apply(e, call, 4, NULL, NULL);
+                pc = in->end - 1;
+                break;
+            }
+
+            case OP_JUMP:
+                pc = in->arg - 1;
+                break;
+
+            case OP_RETURN:
+                return stack[--sp];
+        }
+    }
+}
+
+/* JIT
+
+   A lambda that keeps getting called, whose body only does integer
+   arithmetic, comparisons, if and select on its formals, numbers and
+   calls to itself, is compiled to x86-64 code. Formals are 64-bit
+   integers in an array, results come back in rax. Calls to itself are
+   native calls, or jumps in tail position.
+
+   The code assumes what the globals it uses are bound to. Each is
+   guarded by its symbol's version, checked before every call. Anything
+   the code can't do, like dividing by zero or getting a non-number,
+   bails out: nothing it does has side effects, so the interpreter just
+   does the whole call again and reports the error itself */
+
+#define JIT_THRESHOLD 100
+
+/* Set by --no-jit */
+int jit_disabled = 0;
+
+#ifdef TYSON_JIT
+
+typedef struct {
+    lsym* sym;
+    unsigned version;
+    /* What it must still be bound to: a builtin, a lambda with this
+    body, or else a number */
+    lbuiltin builtin;
+    lval* body;
+    long num;
+} ljit_guard;
+
+struct ljit {
+    void* mem;
+    size_t size;
+    long (*fn)(long* args);
+    ljit_guard* guards;
+    int guard_count;
+    /* The formals it was compiled for. Lambdas can share a body but
+    list them in another order */
+    lsym** formals;
+    int formal_count;
+};
+
+int ljit_same_formals(lval* x, lval* y) {
+    /* Whether lists of formals x and y name the same things in order */
+    x = lval_cells(x);
+    y = lval_cells(y);
+    if (x->count != y->count) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i]->sym != y->cell[i]->sym) { return 0; }
+    }
+    return 1;
+}
+
+/* Set by native code that had to give up, which then goes straight
+back to the entry stub with the stack pointer it saved here */
+static volatile char jit_bail;
+static void* jit_stack;
+
+typedef struct {
+    unsigned char* b;
+    int len;
+    int capacity;
+    lval* f;
+    lval* formals;
+    lenv* root;
+    ljit_guard* guards;
+    int guard_count;
+    /* rel32 jumps to the bail out and return code, patched at the end */
+    int* bails;
+    int bail_count;
+    int* returns;
+    int return_count;
+    /* Where the function starts, and its body after the prologue */
+    int start;
+    int body;
+} ljit_compiler;
+
+void jit_bytes(ljit_compiler* j, int n, ...) {
+    if (j->len + n + 8 > j->capacity) {
+        j->capacity = (j->capacity + n + 8) * 2;
+        j->b = realloc(j->b, j->capacity);
+    }
+    va_list va;
+    va_start(va, n);
+    for (int i = 0; i < n; i++) { j->b[j->len++] = (unsigned char)va_arg(va, int); }
+    va_end(va);
+}
+
+void jit_int32(ljit_compiler* j, int x) {
+    jit_bytes(j, 4, x & 0xff, (x >> 8) & 0xff, (x >> 16) & 0xff, (x >> 24) & 0xff);
+}
+
+void jit_int64(ljit_compiler* j, long x) {
+    jit_int32(j, (int)(x & 0xffffffff));
+    jit_int32(j, (int)((unsigned long)x >> 32));
+}
+
+int jit_jump(ljit_compiler* j, int op) {
+    /* Jump with a rel32 to patch later. op 0xe9 is jmp and 0xe8 call,
+    else the second byte of a jcc, like 0x84 jz or 0x85 jnz */
+    if (op == 0xe9 || op == 0xe8) { jit_bytes(j, 1, op); }
+    else { jit_bytes(j, 2, 0x0f, op); }
+    jit_int32(j, 0);
+    return j->len;
+}
+
+void jit_patch(ljit_compiler* j, int at, int target) {
+    int rel = target - at;
+    memcpy(j->b + at - 4, &rel, 4);
+}
+
+void jit_jump_to(ljit_compiler* j, int** list, int* count, int op) {
+    *list = realloc(*list, sizeof(int) * (*count + 1));
+    (*list)[(*count)++] = jit_jump(j, op);
+}
+
+void jit_return(ljit_compiler* j) {
+    jit_jump_to(j, &j->returns, &j->return_count, 0xe9);
+}
+
+lval* jit_global(ljit_compiler* j, lsym* s) {
+    /* The global value s has as long as its guard holds. NULL if
+    something else binds it, or nothing does */
+    if (s->bound != 1) { return NULL; }
+    int i = lenv_find(j->root, s);
+    if (i == -1) { return NULL; }
+    lval* v = j->root->vals[i];
+
+    for (int g = 0; g < j->guard_count; g++) {
+        if (j->guards[g].sym == s) { return v; }
+    }
+    ljit_guard g = { s, s->version, NULL, NULL, 0 };
+    if (ltype(v) == LVAL_FUN) {
+        g.builtin = v->builtin;
+        if (!v->builtin) { g.body = v->body; }
+    } else if (ltype(v) == LVAL_NUM) {
+        g.num = lnum(v);
+    } else {
+        return NULL;
     }
-    /* Evaluate Sexpressions */
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-    /* All other lval types remain the same */
+    j->guards = realloc(j->guards, sizeof(ljit_guard) * (j->guard_count + 1));
+    j->guards[j->guard_count++] = g;
     return v;
 }
 
+int jit_formal(ljit_compiler* j, lsym* s) {
+    for (int i = 0; i < j->formals->count; i++) {
+        if (j->formals->cell[i]->sym == s) { return i; }
+    }
+    return -1;
+}
+
+int jit_expr(ljit_compiler* j, lval* x, int tail);
+
+int jit_list(ljit_compiler* j, lval* x, int tail);
+
+int jit_operand(ljit_compiler* j, lval* x) {
+    /* Loads x into rcx if it is a number or a formal, leaving rax be.
+    Anything else emits nothing and gives 0 */
+    if (ltype(x) == LVAL_SYM && jit_formal(j, x->sym) != -1) {
+        jit_bytes(j, 3, 0x48, 0x8b, 0x8b);                  /* mov rcx, [rbx+i*8] */
+        jit_int32(j, jit_formal(j, x->sym) * 8);
+        return 1;
+    }
+    lval* v = ltype(x) == LVAL_SYM ? jit_global(j, x->sym) : x;
+    if (!v || ltype(v) != LVAL_NUM) { return 0; }
+    jit_bytes(j, 2, 0x48, 0xb9);                            /* mov rcx, imm64 */
+    jit_int64(j, lnum(v));
+    return 1;
+}
+
+int jit_second(ljit_compiler* j, lval* x) {
+    /* x into rcx, keeping rax */
+    if (jit_operand(j, x)) { return 1; }
+    jit_bytes(j, 1, 0x50);                                  /* push rax */
+    if (!jit_expr(j, x, 0)) { return 0; }
+    jit_bytes(j, 4, 0x48, 0x89, 0xc1, 0x58);                /* mov rcx, rax; pop rax */
+    return 1;
+}
+
+int jit_compare(lbuiltin b) {
+    /* setcc opcode for a comparison builtin, 0 for anything else */
+    return b == builtin_eq ? 0x94 : b == builtin_neq ? 0x95
+        : b == builtin_lt ? 0x9c : b == builtin_gt ? 0x9f
+        : b == builtin_leq ? 0x9e : b == builtin_geq ? 0x9d : 0;
+}
+
+int jit_unless(ljit_compiler* j, lval* x) {
+    /* Jumps when condition x is false. Returns the jump to patch, or 0.
+    A comparison goes straight into the jump */
+    if (ltype(x) == LVAL_SEXPR) { lval_cells(x); }
+    if (ltype(x) == LVAL_SEXPR && x->count == 3 && ltype(x->cell[0]) == LVAL_SYM
+        && jit_formal(j, x->cell[0]->sym) == -1) {
+        lval* f = jit_global(j, x->cell[0]->sym);
+        int cc = f && ltype(f) == LVAL_FUN ? jit_compare(f->builtin) : 0;
+        if (cc) {
+            if (!jit_expr(j, x->cell[1], 0) || !jit_second(j, x->cell[2])) { return 0; }
+            jit_bytes(j, 3, 0x48, 0x39, 0xc8);              /* cmp rax, rcx */
+            return jit_jump(j, (cc ^ 1) - 0x10);            /* jncc */
+        }
+    }
+    if (!jit_expr(j, x, 0)) { return 0; }
+    jit_bytes(j, 3, 0x48, 0x85, 0xc0);                      /* test rax, rax */
+    return jit_jump(j, 0x84);
+}
+
+int jit_call(ljit_compiler* j, lval* x, int tail) {
+    /* Call x of two or more items, its value into rax */
+    if (ltype(x->cell[0]) != LVAL_SYM || jit_formal(j, x->cell[0]->sym) != -1) { return 0; }
+    lval* f = jit_global(j, x->cell[0]->sym);
+    if (!f || ltype(f) != LVAL_FUN) { return 0; }
+    lbuiltin b = f->builtin;
+    int n = x->count - 1;
+
+    /* Calls to itself. Arguments are pushed last first, so they end up
+    in order at rsp */
+    if (!b) {
+        if (f->body != j->f->body || f->env->count || n != j->formals->count
+            || !ljit_same_formals(f->formals, j->formals)) { return 0; }
+        for (int i = n; i >= 1; i--) {
+            if (!jit_expr(j, x->cell[i], 0)) { return 0; }
+            jit_bytes(j, 1, 0x50);                          /* push rax */
+        }
+        if (tail) {
+            for (int i = 0; i < n; i++) {
+                jit_bytes(j, 4, 0x58, 0x48, 0x89, 0x83);    /* pop rax; mov [rbx+i*8], rax */
+                jit_int32(j, i * 8);
+            }
+            jit_jump(j, 0xe9);
+            jit_patch(j, j->len, j->body);
+            return 1;
+        }
+        jit_bytes(j, 3, 0x48, 0x89, 0xe7);                  /* mov rdi, rsp */
+        jit_bytes(j, 1, 0xe8);                              /* call self */
+        jit_int32(j, j->start - (j->len + 4));
+        jit_bytes(j, 3, 0x48, 0x81, 0xc4);                  /* add rsp, n*8 */
+        jit_int32(j, n * 8);
+        return 1;
+    }
+
+    if (b == builtin_if) {
+        if (n != 3 || ltype(x->cell[2]) != LVAL_QEXPR || ltype(x->cell[3]) != LVAL_QEXPR) { return 0; }
+        int other = jit_unless(j, x->cell[1]);
+        if (!other) { return 0; }
+        if (!jit_list(j, x->cell[2], tail)) { return 0; }
+        int end = tail ? 0 : jit_jump(j, 0xe9);
+        jit_patch(j, other, j->len);
+        if (!jit_list(j, x->cell[3], tail)) { return 0; }
+        if (!tail) { jit_patch(j, end, j->len); }
+        return 1;
+    }
+
+    if (b == builtin_select) {
+        int ends[n];
+        for (int i = 1; i <= n; i++) {
+            lval* clause = x->cell[i];
+            if (ltype(clause) != LVAL_QEXPR) { return 0; }
+            lval_cells(clause);
+            if (clause->count != 2) { return 0; }
+            int next = jit_unless(j, clause->cell[0]);
+            if (!next) { return 0; }
+            if (!jit_expr(j, clause->cell[1], tail)) { return 0; }
+            ends[i-1] = tail ? 0 : jit_jump(j, 0xe9);
+            jit_patch(j, next, j->len);
+        }
+        /* No selection found */
+        jit_jump_to(j, &j->bails, &j->bail_count, 0xe9);
+        for (int i = 0; i < n && !tail; i++) { jit_patch(j, ends[i], j->len); }
+        return 1;
+    }
+
+    int cc = jit_compare(b);
+    int arith = b == builtin_add || b == builtin_sub || b == builtin_mul || b == builtin_div;
+    if ((!cc && !arith) || (cc && n != 2) || n == 0) { return 0; }
+
+    if (!jit_expr(j, x->cell[1], 0)) { return 0; }
+    if (b == builtin_sub && n == 1) {
+        jit_bytes(j, 3, 0x48, 0xf7, 0xd8);                  /* neg rax */
+        jit_jump_to(j, &j->bails, &j->bail_count, 0x80);    /* jo */
+    }
+
+    for (int i = 2; i <= n; i++) {
+        if (!jit_second(j, x->cell[i])) { return 0; }
+        if (cc) {
+            jit_bytes(j, 3, 0x48, 0x39, 0xc8);              /* cmp rax, rcx */
+            jit_bytes(j, 6, 0x0f, cc, 0xc0, 0x0f, 0xb6, 0xc0);  /* setcc al; movzx eax, al */
+        } else if (b == builtin_add) {
+            jit_bytes(j, 3, 0x48, 0x01, 0xc8);              /* add rax, rcx */
+            jit_jump_to(j, &j->bails, &j->bail_count, 0x80);  /* jo */
+        } else if (b == builtin_sub) {
+            jit_bytes(j, 3, 0x48, 0x29, 0xc8);              /* sub rax, rcx */
+            jit_jump_to(j, &j->bails, &j->bail_count, 0x80);
+        } else if (b == builtin_mul) {
+            jit_bytes(j, 4, 0x48, 0x0f, 0xaf, 0xc1);        /* imul rax, rcx */
+            jit_jump_to(j, &j->bails, &j->bail_count, 0x80);
+        } else {
+            jit_bytes(j, 3, 0x48, 0x85, 0xc9);              /* test rcx, rcx */
+            jit_jump_to(j, &j->bails, &j->bail_count, 0x84);
+            /* -1 would trap on LONG_MIN, and negating is the same */
+            jit_bytes(j, 4, 0x48, 0x83, 0xf9, 0xff);        /* cmp rcx, -1 */
+            jit_bytes(j, 5, 0x75, 0x0b, 0x48, 0xf7, 0xd8);  /* jne +11; neg rax */
+            jit_jump_to(j, &j->bails, &j->bail_count, 0x80);
+            jit_bytes(j, 2, 0xeb, 0x05);                    /* jmp +5 */
+            jit_bytes(j, 5, 0x48, 0x99, 0x48, 0xf7, 0xf9);  /* cqo; idiv rcx */
+        }
+    }
+    if (tail) { jit_return(j); }
+    return 1;
+}
+
+int jit_list(ljit_compiler* j, lval* x, int tail) {
+    /* x evaluated as an S-expression */
+    lval_cells(x);
+    if (x->count == 0) { return 0; }
+    if (x->count == 1) { return jit_expr(j, x->cell[0], tail); }
+    return jit_call(j, x, tail);
+}
+
+int jit_expr(ljit_compiler* j, lval* x, int tail) {
+    switch (ltype(x)) {
+        case LVAL_NUM:
+            jit_bytes(j, 2, 0x48, 0xb8);                    /* mov rax, imm64 */
+            jit_int64(j, lnum(x));
+            break;
+        case LVAL_SYM: {
+            int i = jit_formal(j, x->sym);
+            if (i != -1) {
+                jit_bytes(j, 3, 0x48, 0x8b, 0x83);          /* mov rax, [rbx+i*8] */
+                jit_int32(j, i * 8);
+                break;
+            }
+            lval* v = jit_global(j, x->sym);
+            if (!v || ltype(v) != LVAL_NUM) { return 0; }
+            jit_bytes(j, 2, 0x48, 0xb8);
+            jit_int64(j, lnum(v));
+            break;
+        }
+        case LVAL_SEXPR:
+            return jit_list(j, x, tail);
+        default:
+            return 0;
+    }
+    if (tail) { jit_return(j); }
+    return 1;
+}
+
+ljit* ljit_compile(lenv* e, lval* f) {
+    /* Native code for lambda f, or NULL if its body is more than we do */
+    lval* formals = lval_cells(f->formals);
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym_amp) { return NULL; }
+    }
+
+    ljit_compiler j = { NULL, 0, 0, f, formals, e };
+    while (j.root->parent) { j.root = j.root->parent; }
+
+    /* Entry stub, saving the stack pointer to bail out to */
+    jit_bytes(&j, 3, 0x53, 0x48, 0xb8);                     /* push rbx; mov rax, &jit_stack */
+    jit_int64(&j, (long)(uintptr_t)&jit_stack);
+    jit_bytes(&j, 3, 0x48, 0x89, 0x20);                     /* mov [rax], rsp */
+    int call = jit_jump(&j, 0xe8);                          /* call start */
+    int done = j.len;
+    jit_bytes(&j, 2, 0x5b, 0xc3);                           /* pop rbx; ret */
+
+    /* The function itself. Formals stay at rbx */
+    j.start = j.len;
+    jit_patch(&j, call, j.start);
+    jit_bytes(&j, 4, 0x53, 0x48, 0x89, 0xfb);               /* push rbx; mov rbx, rdi */
+    j.body = j.len;
+    int ok = jit_list(&j, f->body, 1);
+    int ret = j.len;
+    jit_bytes(&j, 2, 0x5b, 0xc3);                           /* pop rbx; ret */
+
+    int bail = j.len;
+    jit_bytes(&j, 2, 0x48, 0xb9);                           /* mov rcx, &jit_bail */
+    jit_int64(&j, (long)(uintptr_t)&jit_bail);
+    jit_bytes(&j, 5, 0xc6, 0x01, 0x01, 0x48, 0xb8);         /* mov byte [rcx], 1; mov rax, &jit_stack */
+    jit_int64(&j, (long)(uintptr_t)&jit_stack);
+    jit_bytes(&j, 3, 0x48, 0x8b, 0x20);                     /* mov rsp, [rax] */
+    jit_patch(&j, jit_jump(&j, 0xe9), done);
+
+    for (int i = 0; i < j.bail_count; i++) { jit_patch(&j, j.bails[i], bail); }
+    for (int i = 0; i < j.return_count; i++) { jit_patch(&j, j.returns[i], ret); }
+    free(j.bails);
+    free(j.returns);
+
+    void* mem = MAP_FAILED;
+    if (ok) {
+        mem = mmap(NULL, j.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        free(j.b);
+        free(j.guards);
+        return NULL;
+    }
+    memcpy(mem, j.b, j.len);
+    free(j.b);
+    mprotect(mem, j.len, PROT_READ | PROT_EXEC);
+
+    ljit* native = malloc(sizeof(ljit));
+    native->mem = mem;
+    native->size = j.len;
+    native->fn = (long (*)(long*))mem;
+    native->guards = j.guards;
+    native->guard_count = j.guard_count;
+    native->formals = malloc(sizeof(lsym*) * (formals->count ? formals->count : 1));
+    native->formal_count = formals->count;
+    for (int i = 0; i < formals->count; i++) { native->formals[i] = formals->cell[i]->sym; }
+    return native;
+}
+
+void ljit_free(ljit* j) {
+    munmap(j->mem, j->size);
+    free(j->guards);
+    free(j->formals);
+    free(j);
+}
+
+int ljit_guards_hold(ljit* j, lenv* e) {
+    for (int i = 0; i < j->guard_count; i++) {
+        ljit_guard* g = &j->guards[i];
+        if (g->sym->version == g->version) { continue; }
+
+        /* Something changed. Fine as long as it's back to the same */
+        if (g->sym->bound != 1) { return 0; }
+        while (e->parent) { e = e->parent; }
+        int k = lenv_find(e, g->sym);
+        if (k == -1) { return 0; }
+        lval* v = e->vals[k];
+        int same = ltype(v) == LVAL_FUN ?
+            (v->builtin == g->builtin && (v->builtin || (v->body == g->body && !v->env->count)))
+            : (ltype(v) == LVAL_NUM && !g->builtin && !g->body && lnum(v) == g->num);
+        if (!same) { return 0; }
+        g->version = g->sym->version;
+    }
+    return 1;
+}
+
+lval* lval_jit_call(lenv* e, lval* f, lval* a) {
+    /* Result of calling lambda f on a natively, NULL to leave it to the
+    interpreter. Takes ownership of neither */
+    if (f->env->count || a->count != lval_cells(f->formals)->count) { return NULL; }
+    lcode* c = lval_compiled(f);
+
+    if (c->jit == 0 && ++c->calls >= JIT_THRESHOLD) {
+        c->native = ljit_compile(e, f);
+        c->jit = c->native ? 1 : -1;
+    }
+    if (c->jit != 1 || !ljit_guards_hold(c->native, e)) { return NULL; }
+    /* Compiled for another lambda with the same body */
+    lval* formals = lval_cells(f->formals);
+    if (formals->count != c->native->formal_count) { return NULL; }
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym != c->native->formals[i]) { return NULL; }
+    }
+
+    long args[a->count + 1];
+    for (int i = 0; i < a->count; i++) {
+        if (ltype(a->cell[i]) != LVAL_NUM) { return NULL; }
+        args[i] = lnum(a->cell[i]);
+    }
+    jit_bail = 0;
+    long r = c->native->fn(args);
+    return jit_bail ? NULL : lval_num(r);
+}
+
+#else
+
+void ljit_free(ljit* j) {}
+
+#endif
+
+lval* lval_eval_apply(lenv* e, lval* f, lval* v) {
+    /* Evaluates v in e. Given a function f, v is a list of arguments
+    that are already evaluated and f is applied to them instead.
+    Whatever the result is evaluated to next, like a lambda body or an
+    if branch, is a tail call. Those loop here instead of recursing,
+    so tail recursion runs in constant C stack. frame is the env of the
+    lambda call currently being evaluated, if this loop made it */
+    lenv* frame = NULL;
+    lval* x;
+
+    if (f) { goto apply; }
+
+    while (1) {
+        /* Get value of symbol from the given environment */
+        if (ltype(v) == LVAL_SYM) {
+            x = lexical_scope ? lenv_get_resolved(e, v) : lenv_get(e, v);
+            lval_del(v);
+            break;
+        }
+        /* All other lval types remain the same */
+        if (ltype(v) != LVAL_SEXPR) { x = v; break; }
+
+        /* Single Expression. Its value is ours, so it is a tail call too */
+        if (v->count == 1) {
+            lval* child = lval_ref(lval_cells(v)->cell[0]);
+            lval_del(v);
+            v = child;
+            continue;
+        }
+
+        /* Children are replaced by their values, so v must be our own */
+        v = lval_own(v);
+
+        /* Evaluate children first */
+        for (int i = 0; i < v->count; i++) {
+            /* The child is handed over, don't let the gc see it through v meanwhile */
+            lval* child = v->cell[i];
+            v->cell[i] = NULL;
+            v->cell[i] = lval_eval(e, child);
+        }
+
+        /* Erorr checking */
+        int err = -1;
+        for (int i = 0; i < v->count && err == -1; i++) {
+            if (ltype(v->cell[i]) == LVAL_ERR) { err = i; }
+        }
+        if (err != -1) { x = lval_take(v, err); break; }
+
+        /* Empty Expression */
+        if (v->count == 0) { x = v; break; }
+
+        /* Ensure First Element a function after evaluation */
+        f = lval_pop(v, 0);
+        if (ltype(f) != LVAL_FUN) {
+            lval_del(f); lval_del(v);
+            x = lval_err("first element is not a function!");
+            break;
+        }
+
+    apply:
+        /* if, select, case, eval and unpack go on with their expression in the same env */
+        if (f->builtin == builtin_if) { lval_del(f); v = lval_if_branch(v); continue; }
+        if (f->builtin == builtin_select) { lval_del(f); v = lval_select_branch(e, v); continue; }
+        if (f->builtin == builtin_case) { lval_del(f); v = lval_case_branch(e, v); continue; }
+        if (f->builtin == builtin_eval) { lval_del(f); v = lval_eval_expr(v); continue; }
+        if (f->builtin == builtin_unpack) { lval_del(f); v = lval_unpack_expr(v); continue; }
+
+        /* Call the function that f points to, with the given environment */
+        if (f->builtin) {
+            lbuiltin builtin = f->builtin;
+            lval_del(f);
+            x = builtin(e, v);
+            break;
+        }
+
+#ifdef TYSON_JIT
+        if (!jit_disabled) {
+            x = lval_jit_call(e, f, v);
+            if (x) { lval_del(f); lval_del(v); break; }
+        }
+#endif
+
+        /* A full lambda call goes on with its body in a new frame */
+        lenv* next;
+        x = lval_bind(e, f, v, &next);
+        if (!next) { break; }
+        if (frame) { lenv_frame_leave(frame, next); }
+        frame = e = next;
+
+        /* f keeps its body, and so the code, alive while it runs */
+        lval* tail_f;
+        x = lcode_run(lval_compiled(f), e, &tail_f, &v);
+        lval_del(f);
+        if (x) { break; }
+        f = tail_f;
+        goto apply;
+    }
+
+    if (frame) { lenv_frame_release(frame); }
+    return x;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    return lval_eval_apply(e, NULL, v);
+}
+
 lval* builtin_load(lenv* e, lval* a) {
     LASSERT_ARG_NUM("load", a, 1);
     LASSERT_TYPE("load", a, 0, LVAL_STR)
@@ -1008,7 +6211,10 @@ lval* builtin_load(lenv* e, lval* a) {
     /* Parse file from given name (str) */
     mpc_result_t r;
 
-    if (!(mpc_parse_contents(a->cell[0]->str, Lispy, &r))) {
+    char* file = lval_str_dup(a->cell[0]);
+    int parsed = mpc_parse_contents(file, Lispy, &r);
+    free(file);
+    if (!parsed) {
         /* get parse error as string */
         char* err_msg = mpc_err_string(r.error);
         mpc_err_delete(r.error);
@@ -1026,7 +6232,7 @@ lval* builtin_load(lenv* e, lval* a) {
     while (expr->count) {
         lval* x = lval_eval(e, lval_pop(expr, 0));
         /* If error during eval, print */
-        if (x->type == LVAL_ERR) { lval_println(x); }
+        if (ltype(x) == LVAL_ERR) { lval_println(x); }
         lval_del(x);
     }
     lval_del(expr);
@@ -1049,7 +6255,7 @@ int main(int argc, char** argv) {
 
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                              \
-      number  : /-?[0-9]+/ ;                       \
+      number  : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ; \
       symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
       string  : /\"(\\\\.|[^\"])*\"/ ;             \
       comment : /;[^\\r\\n]*/ ;                    \
@@ -1062,6 +6268,19 @@ int main(int argc, char** argv) {
     Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
 
+    /* Options come before any filenames */
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--lexical") == 0) { lexical_scope = 1; }
+        else if (strcmp(argv[first], "--optimize") == 0) { optimize = 1; }
+        else if (strcmp(argv[first], "--no-jit") == 0) { jit_disabled = 1; }
+        else if (strcmp(argv[first], "--dump-optimized") == 0) { optimize = dump_optimized = 1; }
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[first]);
+            return 1;
+        }
+    }
+
   /* Print Version and Exit Information */
   puts("TysonLang Version 1.0.0.0.0");
   puts("Press Ctrl+c to Exit\n");
@@ -1070,8 +6289,8 @@ int main(int argc, char** argv) {
   lenv_add_builtins(e);
 
     /* The user passed in filenames */
-    if (argc >= 2) {
-        for (int i = 1  ; i < argc; i++) {
+    if (argc > first) {
+        for (int i = first; i < argc; i++) {
             if (i == argc - 1 && strcasecmp(argv[argc-1], "repl") == 0) {
                 goto REPL;
             }
@@ -1079,7 +6298,7 @@ int main(int argc, char** argv) {
             /* Run the files  /  load into memory */
             lval* x = builtin_load(e, args);
 
-            if (x->type == LVAL_ERR) { lval_println(x); }
+            if (ltype(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
         }
         return 0;
@@ -1125,18 +6344,25 @@ void format_lval_to_buffer(lval *v, char *buf, size_t bufsize);
 // Wrapper to convert lval to string in a reusable buffer
 void format_lval_to_buffer(lval *v, char *buf, size_t bufsize) {
     // Simplified version; expand with full support as needed
-    if (v->type == LVAL_NUM) {
-        snprintf(buf, bufsize, "%li", v->num);
+    if (ltype(v) == LVAL_NUM) {
+        snprintf(buf, bufsize, "%li", lnum(v));
+    } else if (v->type == LVAL_FLOAT) {
+        lval_float_str(buf, bufsize, v->fnum);
+    } else if (v->type == LVAL_BIG) {
+        char* digits = lval_big_str(v);
+        snprintf(buf, bufsize, "%s", digits);
+        free(digits);
     } else if (v->type == LVAL_ERR) {
         snprintf(buf, bufsize, "Error: %s", v->err);
     } else if (v->type == LVAL_SYM) {
-        snprintf(buf, bufsize, "%s", v->sym);
+        snprintf(buf, bufsize, "%s", v->sym->name);
     } else if (v->type == LVAL_STR) {
-        snprintf(buf, bufsize, "\"%s\"", v->str);  // optionally escape
+        snprintf(buf, bufsize, "\"%.*s\"", (int)v->len, lval_chars(v));  // optionally escape
     } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
         char open = (v->type == LVAL_SEXPR) ? '(' : '{';
         char close = (v->type == LVAL_SEXPR) ? ')' : '}';
         size_t pos = 0;
+        lval_cells(v);
         pos += snprintf(buf + pos, bufsize - pos, "%c", open);
         for (int i = 0; i < v->count && pos < bufsize - 1; i++) {
             char tmp[256];
@@ -1147,6 +6373,47 @@ void format_lval_to_buffer(lval *v, char *buf, size_t bufsize) {
             }
         }
         snprintf(buf + pos, bufsize - pos, "%c", close);
+    } else if (v->type == LVAL_VEC) {
+        size_t pos = snprintf(buf, bufsize, "[");
+        for (long i = 0; i < v->length && pos < bufsize - 1; i++) {
+            pos += snprintf(buf + pos, bufsize - pos, i ? " %li" : "%li", (long)v->ints[i]);
+        }
+        if (pos < bufsize - 1) { snprintf(buf + pos, bufsize - pos, "]"); }
+    } else if (v->type == LVAL_MAP || v->type == LVAL_SET || v->type == LVAL_SORTED) {
+        lval** vals;
+        lval** keys = lval_map_entries(v, &vals);
+        size_t pos = snprintf(buf, bufsize, v->type == LVAL_MAP ? "(hashmap {"
+            : v->type == LVAL_SET ? "(hashset {" : "(sortedmap {");
+        for (long i = 0; i < v->mcount && pos < bufsize - 1; i++) {
+            char k[256], x[256];
+            format_lval_to_buffer(keys[i], k, sizeof(k));
+            if (v->type == LVAL_SET) {
+                pos += snprintf(buf + pos, bufsize - pos, i ? " %s" : "%s", k);
+            } else {
+                format_lval_to_buffer(vals[i], x, sizeof(x));
+                pos += snprintf(buf + pos, bufsize - pos, i ? " {%s %s}" : "{%s %s}", k, x);
+            }
+        }
+        if (pos < bufsize - 1) { snprintf(buf + pos, bufsize - pos, "})"); }
+        free(keys);
+        free(vals);
+    } else if (v->type == LVAL_PQ) {
+        lval** cell = malloc(sizeof(lval*) * (v->hsize ? v->hsize : 1));
+        if (v->hroot) { lval_heap_fill(v->hroot, cell, 0); }
+        size_t pos = snprintf(buf, bufsize, "(pq ");
+        if (v->horder) {
+            char f[256];
+            format_lval_to_buffer(v->horder, f, sizeof(f));
+            pos += snprintf(buf + pos, bufsize - pos, "%s ", f);
+        }
+        if (pos < bufsize - 1) { pos += snprintf(buf + pos, bufsize - pos, "{"); }
+        for (long i = 0; i < v->hsize && pos < bufsize - 1; i++) {
+            char x[256];
+            format_lval_to_buffer(cell[i], x, sizeof(x));
+            pos += snprintf(buf + pos, bufsize - pos, i ? " %s" : "%s", x);
+        }
+        if (pos < bufsize - 1) { snprintf(buf + pos, bufsize - pos, "})"); }
+        free(cell);
     } else {
         snprintf(buf, bufsize, "<unknown>");
     }
@@ -1170,7 +6437,7 @@ void tyson_init() {
 
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                              \
-      number  : /-?[0-9]+/ ;                       \
+      number  : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ; \
       symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
       string  : /\"(\\\\.|[^\"])*\"/ ;             \
       comment : /;[^\\r\\n]*/ ;                    \
@@ -1190,7 +6457,7 @@ void tyson_init() {
     /* Run the files  /  load into memory */
     lval* x = builtin_load(e, args);
 
-    if (x->type == LVAL_ERR) { lval_println(x); }
+    if (ltype(x) == LVAL_ERR) { lval_println(x); }
     lval_del(x);
 }
 